@@ -0,0 +1,154 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "genotype_matrix.h"
+
+using std::copy;
+using std::shared_ptr;
+using std::vector;
+
+GenotypeMatrix::GenotypeMatrix(const vector<int>& nindividuals, size_t nloci, Layout layout)
+    : nloci(nloci), stripe_layout(layout)
+{
+    set_dimensions(nindividuals);
+    owned.assign(total_words(), ~(uint64_t)0);
+    words = owned.data();
+}
+
+
+
+GenotypeMatrix::GenotypeMatrix(const vector<int>& nindividuals, size_t nloci, Layout layout,
+                               shared_ptr<const MappedFile> file, const uint64_t* codes)
+    : nloci(nloci), stripe_layout(layout), words(codes), mapping(file)
+{
+    set_dimensions(nindividuals);
+}
+
+
+
+void GenotypeMatrix::set_dimensions(const vector<int>& nindividuals)
+{
+    row_offset.assign(1, 0);
+    for (size_t t = 0; t < nindividuals.size(); ++t) {
+        row_offset.push_back(row_offset[t] + nindividuals[t]);
+    }
+
+    if (stripe_layout == INDIVIDUAL_MAJOR) {
+        nstripes = total_rows();
+        nstripe_words = (nloci + CODES_PER_WORD - 1) / CODES_PER_WORD;
+        indiv_stride = nstripe_words*CODES_PER_WORD;
+        locus_stride = 1;
+    }
+    else {
+        nstripes = nloci;
+        nstripe_words = (total_rows() + CODES_PER_WORD - 1) / CODES_PER_WORD;
+        indiv_stride = 1;
+        locus_stride = nstripe_words*CODES_PER_WORD;
+    }
+}
+
+
+
+void GenotypeMatrix::release_codes()
+{
+    vector<uint64_t>().swap(owned);
+    mapping.reset();
+    words = NULL;
+}
+
+
+
+GenotypeMatrix GenotypeMatrix::select_loci(const vector<size_t>& loci) const
+{
+    vector<int> nindividuals;
+    for (size_t t = 0; t < total_time_steps(); ++t)
+        nindividuals.push_back(total_individuals(t));
+    GenotypeMatrix selected(nindividuals, loci.size(), stripe_layout);
+
+    if (stripe_layout == LOCUS_MAJOR) {
+        #pragma omp parallel for
+        for (size_t l = 0; l < loci.size(); ++l)
+            copy(stripe(loci[l]), stripe(loci[l]) + nstripe_words, selected.stripe(l));
+    }
+    else {
+        #pragma omp parallel for
+        for (size_t i = 0; i < total_rows(); ++i) {
+            const uint64_t* s = stripe(i);
+            uint64_t* dest = selected.stripe(i);
+            for (size_t l = 0; l < loci.size(); ++l) {
+                uint64_t c = (s[loci[l] / CODES_PER_WORD] >> (2*(loci[l] % CODES_PER_WORD))) & 3;
+                dest[l / CODES_PER_WORD] ^= (3 ^ c) << (2*(l % CODES_PER_WORD));
+            }
+        }
+    }
+    selected.het_rows = heterozygous_rows();
+    return selected;
+}
+
+
+
+void GenotypeMatrix::locus_codes(size_t locus, unsigned char* codes) const
+{
+    if (stripe_layout == LOCUS_MAJOR) {
+        const uint64_t* s = stripe(locus);
+        for (size_t i = 0; i < total_rows(); ++i)
+            codes[i] = (s[i / CODES_PER_WORD] >> (2*(i % CODES_PER_WORD))) & 3;
+    }
+    else {
+        for (size_t i = 0; i < total_rows(); ++i)
+            codes[i] = (stripe(i)[locus / CODES_PER_WORD] >> (2*(locus % CODES_PER_WORD))) & 3;
+    }
+}
+
+
+
+vector<bool> GenotypeMatrix::heterozygous_rows() const
+{
+    if (!het_rows.empty())
+        return het_rows;
+
+    vector<bool> het(total_rows(), false);
+    if (stripe_layout == INDIVIDUAL_MAJOR) {
+        // vector<bool> packs bits, so threads write to a vector<char> instead
+        vector<char> any_het(total_rows(), 0);
+        #pragma omp parallel for
+        for (size_t i = 0; i < total_rows(); ++i) {
+            uint64_t any = 0;
+            for (size_t w = 0; w < nstripe_words; ++w)
+                any |= heterozygous_mask(stripe(i)[w]);
+            any_het[i] = (any != 0);
+        }
+        for (size_t i = 0; i < total_rows(); ++i)
+            het[i] = any_het[i];
+    }
+    else {
+        vector<uint64_t> any(nstripe_words, 0);
+        for (size_t l = 0; l < nloci; ++l) {
+            for (size_t w = 0; w < nstripe_words; ++w)
+                any[w] |= heterozygous_mask(stripe(l)[w]);
+        }
+        for (size_t i = 0; i < total_rows(); ++i)
+            het[i] = (any[i / CODES_PER_WORD] >> (2*(i % CODES_PER_WORD))) & 1;
+    }
+    return het;
+}
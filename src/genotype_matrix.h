@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GENOTYPE_MATRIX_H
+#define GENOTYPE_MATRIX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Genotypes of individuals grouped by time step, stored with 2 bits per
+// genotype. Codes 0, 1 and 2 count alleles and code 3 marks missing data.
+//
+// Genotypes are packed into stripes of 64-bit words, 32 genotypes per word.
+// In the INDIVIDUAL_MAJOR layout each stripe holds every locus of one
+// individual. In the LOCUS_MAJOR layout each stripe holds every individual
+// at one locus, so a sweep over all individuals at a locus reads a few
+// contiguous cache lines.
+class GenotypeMatrix
+{
+    public:
+        enum Layout { INDIVIDUAL_MAJOR, LOCUS_MAJOR };
+
+        static const int      MISSING = 3;
+        static const size_t   CODES_PER_WORD = 32;
+
+        GenotypeMatrix() : nloci(0), nstripes(0), nstripe_words(0), indiv_stride(0), locus_stride(0), stripe_layout(INDIVIDUAL_MAJOR), words(NULL) { }
+        // nindividuals[t] gives the number of individuals sampled at time step t.
+        // All genotypes are initially missing.
+        GenotypeMatrix(const std::vector<int>& nindividuals, size_t nloci, Layout layout);
+        // a read-only matrix whose codes are total_words() words stored in a
+        // mapped file, starting at codes
+        GenotypeMatrix(const std::vector<int>& nindividuals, size_t nloci, Layout layout,
+                       std::shared_ptr<const MappedFile> file, const uint64_t* codes);
+
+        // movable but not copyable, since the codes may be owned by the matrix
+        GenotypeMatrix(GenotypeMatrix&&) = default;
+        GenotypeMatrix& operator=(GenotypeMatrix&&) = default;
+
+        Layout layout() const                                             { return stripe_layout; }
+        size_t total_time_steps() const                                   { return row_offset.size() - 1; }
+        size_t total_individuals(size_t time) const                       { return row_offset[time + 1] - row_offset[time]; }
+        size_t total_rows() const                                         { return row_offset.back(); }
+        size_t total_loci() const                                         { return nloci; }
+
+        // individuals are numbered consecutively across time steps
+        size_t row_index(size_t time, size_t indiv) const                 { return row_offset[time] + indiv; }
+
+        int code(size_t time, size_t indiv, size_t locus) const
+        {
+            size_t e = row_index(time, indiv)*indiv_stride + locus*locus_stride;
+            return (words[e / CODES_PER_WORD] >> (2*(e % CODES_PER_WORD))) & 3;
+        }
+
+        // stripe i is the individual with row index i in the INDIVIDUAL_MAJOR
+        // layout, and locus i in the LOCUS_MAJOR layout. Entries past the end
+        // of a stripe are missing.
+        size_t          stripe_words() const                              { return nstripe_words; }
+        const uint64_t* stripe(size_t i) const                            { return words + i*nstripe_words; }
+        uint64_t*       stripe(size_t i)                                  { return &owned[i*nstripe_words]; }
+
+        // all stripes, stored consecutively
+        size_t          total_words() const                               { return nstripes*nstripe_words; }
+        const uint64_t* data() const                                      { return words; }
+
+        // decodes the genotype codes of every row at one locus into codes
+        void locus_codes(size_t locus, unsigned char* codes) const;
+
+        // frees the genotype codes, keeping the dimensions of the matrix
+        void release_codes();
+
+        // returns a matrix with the same rows and layout holding only the given
+        // loci, in the given order. The heterozygous rows of this matrix carry
+        // over, so dropping loci does not change which rows are hemizygous.
+        GenotypeMatrix select_loci(const std::vector<size_t>& loci) const;
+
+        // returns true for each row holding at least one heterozygous genotype.
+        // The rows are scanned unless the flags were set beforehand.
+        std::vector<bool> heterozygous_rows() const;
+        void              set_heterozygous_rows(const std::vector<bool>& heterozygous) { het_rows = heterozygous; }
+
+        // bit masks with the low bit of each 2-bit code set if the code is
+        // missing or heterozygous, respectively
+        static uint64_t missing_mask(uint64_t w)                          { return w & (w >> 1) & 0x5555555555555555ULL; }
+        static uint64_t heterozygous_mask(uint64_t w)                     { return w & ~(w >> 1) & 0x5555555555555555ULL; }
+
+    private:
+        void set_dimensions(const std::vector<int>& nindividuals);
+
+        std::vector<size_t>               row_offset;       // row_offset[t] is the row of the first individual sampled at time step t
+        size_t                            nloci;
+        size_t                            nstripes;
+        size_t                            nstripe_words;
+        size_t                            indiv_stride;     // distance in codes between consecutive individuals
+        size_t                            locus_stride;     // distance in codes between consecutive loci
+        Layout                            stripe_layout;
+        const uint64_t*                   words;            // the codes, either owned or in mapping
+        std::vector<uint64_t>             owned;
+        std::shared_ptr<const MappedFile> mapping;
+        std::vector<bool>                 het_rows;
+};
+
+#endif
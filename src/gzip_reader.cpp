@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+#include "gzip_reader.h"
+
+using std::cerr;
+using std::condition_variable;
+using std::endl;
+using std::exit;
+using std::ifstream;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+bool is_gzip(string fname)
+{
+    ifstream input(fname, std::ios::binary);
+    unsigned char magic[2] = { 0, 0 };
+    input.read((char*)magic, 2);
+    return input.gcount() == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+
+
+GzipLineReader::GzipLineReader(string fname)
+    : fname(fname), buffers(NBUFFERS, vector<char>(BUFFER_SIZE)), filled(NBUFFERS, 0),
+      nfull(0), next_buffer(0), holding(false), done(false), stop(false)
+{
+    file = gzopen(fname.c_str(), "rb");
+    if (file == NULL) {
+        cerr << "cannot open " << fname << endl;
+        exit(1);
+    }
+    gzbuffer(file, 1 << 17);
+    worker = thread(&GzipLineReader::decompress, this);
+}
+
+
+
+GzipLineReader::~GzipLineReader()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    worker.join();
+    gzclose(file);
+}
+
+
+
+void GzipLineReader::decompress()
+{
+    for (size_t b = 0; ; b = (b + 1) % NBUFFERS) {
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [this] { return nfull < NBUFFERS || stop; });
+            if (stop)
+                return;
+        }
+
+        // buffer b is free, so it can be filled without holding the lock
+        int n = gzread(file, &buffers[b][0], BUFFER_SIZE);
+        {
+            unique_lock<mutex> guard(lock);
+            filled[b] = n;
+            nfull++;
+        }
+        changed.notify_all();
+        if (n <= 0)
+            return;
+    }
+}
+
+
+
+bool GzipLineReader::next_lines(vector<pair<const char*, const char*> >& lines)
+{
+    lines.clear();
+    if (done)
+        return false;
+
+    int n;
+    const char* data;
+    {
+        unique_lock<mutex> guard(lock);
+        if (holding) {
+            nfull--;
+            holding = false;
+            changed.notify_all();
+        }
+        changed.wait(guard, [this] { return nfull > 0; });
+        holding = true;
+        data = &buffers[next_buffer][0];
+        n = filled[next_buffer];
+        next_buffer = (next_buffer + 1) % NBUFFERS;
+    }
+
+    // a truncated file ends without a negative count, but sets an error
+    int errnum = Z_OK;
+    const char* message = (n <= 0) ? gzerror(file, &errnum) : NULL;
+    if (n < 0 || errnum != Z_OK) {
+        cerr << "error decompressing " << fname << ": " << message << endl;
+        exit(1);
+    }
+    if (n == 0) {
+        // the end of the file; a last line without a newline is in carry
+        done = true;
+        if (carry.empty())
+            return false;
+        joined.swap(carry);
+        carry.clear();
+        lines.push_back(pair<const char*, const char*>(joined.data(), joined.data() + joined.size()));
+        return true;
+    }
+
+    const char* p = data;
+    const char* end = data + n;
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    if (nl == NULL) {
+        carry.append(p, end);
+        return true;
+    }
+    if (!carry.empty()) {
+        joined.swap(carry);
+        carry.clear();
+        joined.append(p, nl);
+        lines.push_back(pair<const char*, const char*>(joined.data(), joined.data() + joined.size()));
+    }
+    else {
+        lines.push_back(pair<const char*, const char*>(p, nl));
+    }
+    p = nl + 1;
+
+    while (p < end && (nl = (const char*)memchr(p, '\n', end - p)) != NULL) {
+        lines.push_back(pair<const char*, const char*>(p, nl));
+        p = nl + 1;
+    }
+    carry.assign(p, end);
+    return true;
+}
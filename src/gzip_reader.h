@@ -0,0 +1,74 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GZIP_READER_H
+#define GZIP_READER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+// returns true if the file starts with the gzip magic number
+bool is_gzip(std::string fname);
+
+// Reads the lines of a gzip compressed file. A background thread
+// decompresses the file into a ring of buffers, so the lines of one buffer
+// can be parsed while the following buffers are decompressed.
+class GzipLineReader
+{
+    public:
+        GzipLineReader(std::string fname);
+        ~GzipLineReader();
+
+        // sets lines to the [begin, end) ranges of the complete lines that
+        // follow the lines returned by the previous call, without their
+        // newlines. The ranges are valid until the next call. Returns false
+        // once every line has been returned.
+        bool next_lines(std::vector<std::pair<const char*, const char*> >& lines);
+
+    private:
+        GzipLineReader(const GzipLineReader&);
+        GzipLineReader& operator=(const GzipLineReader&);
+
+        void decompress();
+
+        static const size_t             NBUFFERS = 4;
+        static const size_t             BUFFER_SIZE = 1 << 22;
+
+        std::string                     fname;
+        gzFile                          file;
+        std::vector<std::vector<char> > buffers;
+        std::vector<int>                filled;         // bytes decompressed into each buffer, 0 at the end of the file
+        size_t                          nfull;          // buffers filled and not yet released by next_lines
+        size_t                          next_buffer;    // buffer next_lines reads next
+        bool                            holding;        // true if next_lines has not released its last buffer
+        bool                            done;
+        bool                            stop;
+        std::string                     carry;          // a line split between two buffers
+        std::string                     joined;
+        std::mutex                      lock;
+        std::condition_variable         changed;
+        std::thread                     worker;
+};
+
+#endif
@@ -23,11 +23,12 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #include <getopt.h>
 #include <iostream>
 #include <iomanip>
-#include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "genotype_matrix.h"
+#include "sample_table.h"
 #include "svi.h"
 #include "snp_data.h"
 #include "util.h"
@@ -39,8 +40,6 @@ using std::cerr;
 using std::cout;
 using std::exit;
 using std::endl;
-using std::map;
-using std::pair;
 using std::setprecision;
 using std::string;
 using std::vector;
@@ -59,8 +58,17 @@ void print_help()
     cerr << "\t--input FILE                " << "Path to genotype matrix: a LOCI x INDIVIDUAL matrix of genotypes in the" << endl
          << "                                    EIGENSTRAT genotype format. Each genotype is denoted by either 0, 1, 2, or 9," << endl
          << "                                    where 9 identifies missing entries. There are no spaces between entries." << endl
+         << "                                    Packed EIGENSTRAT (PACKEDANCESTRYMAP) files are detected automatically." << endl
          << "                                    See https://github.com/DReichLab/EIG/tree/master/CONVERTF for more details" << endl
          << "                                    and converting between standard formats." << endl;
+    cerr << "\t--bed FILE                  " << "Alternative to --input. Path to a PLINK .bed file in SNP-major order. The" << endl
+         << "                                    .bim and .fam files are expected next to it with the same prefix." << endl;
+    cerr << "\t--vcf FILE                  " << "Alternative to --input. Path to a VCF file. Genotypes are read from the GT" << endl
+         << "                                    field and count copies of the alternate alleles. Samples with only haploid" << endl
+         << "                                    calls are treated as hemizygous." << endl;
+    cerr << "\t--cache FILE                " << "Alternative to --input and --generation-times. Path to a dataset cache written" << endl
+         << "                                    by --write-cache. The cache is memory-mapped, so startup does not depend on" << endl
+         << "                                    the size of the dataset. The genotype layout is fixed by the cache." << endl;
     cerr << "\t--generation-times FILE     " << "Path to generation times corresponding to the input file. A list of generation" << endl
          << "                                    times (one per line) for each sample. Samples are assumed to be in the same" << endl;
     cerr << "                                    order as the columns of the input matrix." << endl; 
@@ -81,6 +89,50 @@ void print_help()
     cerr << "\t--epochs INT                " << "(=50) Optional. Number of epochs to run before terminating." << endl;
     cerr << "\t--no-multi-init             " << "(=false) Optional. Turns off multiple initialization." << endl;
     cerr << "\t--no-pseudo-haploid         " << "(=false) Optional. If set, treats pseudo haploid individuals as diploid." << endl;
+    cerr << "\t--sparse-threshold DOUBLE   " << "(=0.5) Optional. If at least this fraction of genotypes is missing, only the" << endl
+         << "                                    observed genotypes are kept in memory." << endl;
+    cerr << "\t--genotype-layout STR       " << "(=locus) Optional. Memory layout of the genotype matrix: 'locus' stores the" << endl
+         << "                                    individuals at each locus together, 'individual' stores the loci of each" << endl
+         << "                                    individual together." << endl;
+    cerr << "\t--time-bin-width INT        " << "Optional. Groups the generation times into bins of this many generations, so" << endl
+         << "                                    that samples in a bin share a time step. Samples at the earliest and latest" << endl
+         << "                                    times keep them, and other samples take the mean time of their bin, rounded" << endl
+         << "                                    down, as in supp/scripts/bin_sample_times.py. Fewer time steps trade" << endl
+         << "                                    temporal resolution for speed." << endl;
+    cerr << "\t--max-time-steps INT        " << "Optional. Widens the generation time bins until there are at most this many" << endl
+         << "                                    time steps, which must be at least 2." << endl;
+    cerr << "\t--smoother-solver STR       " << "(=cg) Optional. Method used to fit the allele frequency trajectories at each" << endl
+         << "                                    locus: 'cg' for conjugate gradient, or 'newton' for Newton's method, which" << endl
+         << "                                    needs fewer iterations when there are many time steps." << endl;
+    cerr << "\t--loci FILE                 " << "Optional. Only loads the listed loci: 1-based locus numbers or inclusive ranges" << endl
+         << "                                    such as 1001-2000, separated by whitespace or commas." << endl;
+    cerr << "\t--samples FILE              " << "Optional. Only loads the samples listed in the first column of FILE, one per" << endl
+         << "                                    line. Samples are given by ID if IDs are known (see --ind), and otherwise" << endl
+         << "                                    by their 1-based position in the input. The generation times file still" << endl
+         << "                                    lists every sample in the input, and output files list the selected" << endl
+         << "                                    samples in input order." << endl;
+    cerr << "\t--ind FILE                  " << "Optional. EIGENSTRAT .ind file giving the sample IDs used by --samples. IDs" << endl
+         << "                                    are read from the .fam file with --bed and from the header with --vcf." << endl;
+    cerr << "\t--min-maf DOUBLE            " << "(=0) Optional. Drops loci whose minor allele frequency among the observed" << endl
+         << "                                    genotypes is below this value." << endl;
+    cerr << "\t--max-missing DOUBLE        " << "(=1) Optional. Drops loci with more than this fraction of missing genotypes." << endl;
+    cerr << "\t--min-minor-alleles INT     " << "(=0) Optional. Drops loci with fewer copies of the minor allele: 1 drops" << endl
+         << "                                    monomorphic loci and 2 also drops singletons. If any locus filter is set," << endl
+         << "                                    loci without observed genotypes are dropped and the input locus numbers of" << endl
+         << "                                    the kept loci are written to the _loci output file." << endl;
+    cerr << "\t--merge-duplicate-loci      " << "(=false) Optional. Loci with the same genotypes in every sample are fitted" << endl
+         << "                                    once and weighted by their number of copies, which shortens each epoch." << endl
+         << "                                    Output files still list every locus." << endl;
+    cerr << "\t--snp FILE                  " << "Optional. EIGENSTRAT .snp file (or PLINK .bim file) giving the chromosome and" << endl
+         << "                                    position of each locus in the input. Output allele frequencies are" << endl
+         << "                                    annotated with the locus, the hold out log likelihood is also reported" << endl
+         << "                                    per chromosome, and blocks of loci in --scratch-dir do not span" << endl
+         << "                                    chromosomes." << endl;
+    cerr << "\t--scratch-dir DIR           " << "Optional. Runs out of core: the per-locus variational parameters are kept in" << endl
+         << "                                    temporary files in DIR that are mapped into memory, and loci are visited in" << endl
+         << "                                    blocks. Use with --cache so that the genotypes are mapped as well." << endl;
+    cerr << "\t--write-cache FILE          " << "Optional. Writes the loaded dataset to a binary cache that can be passed to" << endl
+         << "                                    --cache in later runs. The cache uses the byte order of this machine." << endl;
     /*cerr << "\t--labels FILE               " << "Optional. Experimental. Population label file path for supervised analysis." << endl 
          << "                                    Labels should be in {0,...,npops - 1}. One label per line in the same order" << endl
          << "                                    as the input matrix. Individuals without a population assignment should be" << endl
@@ -91,6 +143,9 @@ void print_help()
 enum OPTIONS
 {
     INPUT,
+    BED,
+    VCF,
+    CACHE,
     GENERATION_TIMES,
     OUTPUT,
     NPOPS,
@@ -102,6 +157,21 @@ enum OPTIONS
     EPOCHS,
     MULTI_INIT,
     PSUEDO_HAPLOID,
+    GENOTYPE_LAYOUT,
+    SPARSE_THRESHOLD,
+    WRITE_CACHE,
+    SCRATCH_DIR,
+    LOCI,
+    SAMPLES,
+    IND,
+    SNP,
+    MIN_MAF,
+    MAX_MISSING,
+    MIN_MINOR_ALLELES,
+    MERGE_DUPLICATE_LOCI,
+    TIME_BIN_WIDTH,
+    MAX_TIME_STEPS,
+    SMOOTHER_SOLVER,
     LABELS
 };
 
@@ -109,6 +179,9 @@ enum OPTIONS
 static struct option long_options[] =
 {
     {"input"             , required_argument, NULL, INPUT             },
+    {"bed"               , required_argument, NULL, BED               },
+    {"vcf"               , required_argument, NULL, VCF               },
+    {"cache"             , required_argument, NULL, CACHE             },
     {"generation-times"  , required_argument, NULL, GENERATION_TIMES  },
     {"output"            , required_argument, NULL, OUTPUT            },
     {"npops"             , required_argument, NULL, NPOPS             },
@@ -120,6 +193,21 @@ static struct option long_options[] =
     {"epochs"            , required_argument, NULL, EPOCHS            },
     {"no-multi-init"     , no_argument      , NULL, MULTI_INIT        },
     {"no-pseudo-haploid" , no_argument      , NULL, PSUEDO_HAPLOID    },
+    {"genotype-layout"   , required_argument, NULL, GENOTYPE_LAYOUT   },
+    {"sparse-threshold"  , required_argument, NULL, SPARSE_THRESHOLD  },
+    {"write-cache"       , required_argument, NULL, WRITE_CACHE       },
+    {"scratch-dir"       , required_argument, NULL, SCRATCH_DIR       },
+    {"loci"              , required_argument, NULL, LOCI              },
+    {"samples"           , required_argument, NULL, SAMPLES           },
+    {"ind"               , required_argument, NULL, IND               },
+    {"snp"               , required_argument, NULL, SNP               },
+    {"min-maf"           , required_argument, NULL, MIN_MAF           },
+    {"max-missing"       , required_argument, NULL, MAX_MISSING       },
+    {"min-minor-alleles" , required_argument, NULL, MIN_MINOR_ALLELES },
+    {"merge-duplicate-loci", no_argument    , NULL, MERGE_DUPLICATE_LOCI },
+    {"time-bin-width"    , required_argument, NULL, TIME_BIN_WIDTH    },
+    {"max-time-steps"    , required_argument, NULL, MAX_TIME_STEPS    },
+    {"smoother-solver"   , required_argument, NULL, SMOOTHER_SOLVER   },
     {"labels"            , required_argument, NULL, LABELS            },
     {NULL, no_argument, NULL, 0}
 };
@@ -135,6 +223,9 @@ int main(int argc, char* const argv[])
     }
 
     string in_file           = "";
+    string bed_file          = "";
+    string vcf_file          = "";
+    string cache_file        = "";
     string in_gen_times_file = "";
     string out_file          = "";
     int random_seed          = 0;
@@ -147,6 +238,18 @@ int main(int argc, char* const argv[])
     string label_file        = "";
     bool multi_init          = true;
     bool pseudo_haploid      = true;
+    string genotype_layout   = "locus";
+    string smoother_solver   = "cg";
+    double sparse_threshold  = 0.5;
+    string write_cache_file  = "";
+    string scratch_dir       = "";
+    string loci_file         = "";
+    string samples_file      = "";
+    string ind_file          = "";
+    string snp_file          = "";
+    LocusFilter locus_filter;
+    bool merge_duplicates    = false;
+    TimeBinning time_binning;
 
     int c;
     int option_index;
@@ -155,6 +258,15 @@ int main(int argc, char* const argv[])
             case INPUT:
                 in_file = optarg;
                 break;
+            case BED:
+                bed_file = optarg;
+                break;
+            case VCF:
+                vcf_file = optarg;
+                break;
+            case CACHE:
+                cache_file = optarg;
+                break;
             case GENERATION_TIMES:
                 in_gen_times_file = optarg;
                 break;
@@ -185,6 +297,51 @@ int main(int argc, char* const argv[])
             case PSUEDO_HAPLOID:
                 pseudo_haploid = false;
                 break;
+            case GENOTYPE_LAYOUT:
+                genotype_layout = optarg;
+                break;
+            case SPARSE_THRESHOLD:
+                sparse_threshold = atof(optarg);
+                break;
+            case WRITE_CACHE:
+                write_cache_file = optarg;
+                break;
+            case SCRATCH_DIR:
+                scratch_dir = optarg;
+                break;
+            case LOCI:
+                loci_file = optarg;
+                break;
+            case SAMPLES:
+                samples_file = optarg;
+                break;
+            case IND:
+                ind_file = optarg;
+                break;
+            case SNP:
+                snp_file = optarg;
+                break;
+            case MIN_MAF:
+                locus_filter.min_maf = atof(optarg);
+                break;
+            case MAX_MISSING:
+                locus_filter.max_missing = atof(optarg);
+                break;
+            case MIN_MINOR_ALLELES:
+                locus_filter.min_minor_alleles = atoi(optarg);
+                break;
+            case MERGE_DUPLICATE_LOCI:
+                merge_duplicates = true;
+                break;
+            case TIME_BIN_WIDTH:
+                time_binning.width = atoi(optarg);
+                break;
+            case MAX_TIME_STEPS:
+                time_binning.max_steps = atoi(optarg);
+                break;
+            case SMOOTHER_SOLVER:
+                smoother_solver = optarg;
+                break;
             case MULTI_INIT:
                 multi_init = false;
                 break;
@@ -199,11 +356,23 @@ int main(int argc, char* const argv[])
     }
 
     // check input
-    if (in_file == "") {
+    if (in_file == "" && bed_file == "" && vcf_file == "" && cache_file == "") {
         cerr << "missing argument: --input" << endl;
         return 1;
     }
-    else if (in_gen_times_file == "") {
+    else if ((in_file != "") + (bed_file != "") + (vcf_file != "") + (cache_file != "") > 1) {
+        cerr << "argument error: only one of --input, --bed, --vcf and --cache can be used" << endl;
+        return 1;
+    }
+    else if (cache_file != "" && (loci_file != "" || samples_file != "")) {
+        cerr << "argument error: --loci and --samples cannot be used with --cache" << endl;
+        return 1;
+    }
+    else if (cache_file != "" && time_binning.active()) {
+        cerr << "argument error: --time-bin-width and --max-time-steps cannot be used with --cache" << endl;
+        return 1;
+    }
+    else if (in_gen_times_file == "" && cache_file == "") {
         cerr << "missing argument: --generation-times" << endl;
         return 1;
     }
@@ -231,20 +400,99 @@ int main(int argc, char* const argv[])
         cerr << "--epochs must be greater than 0" << endl;
         return 1;
     }
+    else if (genotype_layout != "locus" && genotype_layout != "individual") {
+        cerr << "--genotype-layout must be either locus or individual" << endl;
+        return 1;
+    }
+    else if (smoother_solver != "cg" && smoother_solver != "newton") {
+        cerr << "--smoother-solver must be either cg or newton" << endl;
+        return 1;
+    }
+    else if (time_binning.width < 0 || time_binning.max_steps < 0) {
+        cerr << "--time-bin-width and --max-time-steps must be positive" << endl;
+        return 1;
+    }
+    else if (time_binning.max_steps == 1) {
+        cerr << "--max-time-steps must be at least 2, since binning keeps the earliest and latest generation times" << endl;
+        return 1;
+    }
+    else if (locus_filter.min_maf < 0 || locus_filter.min_maf > 0.5) {
+        cerr << "--min-maf must be in [0, 0.5]" << endl;
+        return 1;
+    }
+    else if (locus_filter.max_missing < 0 || locus_filter.max_missing > 1) {
+        cerr << "--max-missing must be in [0, 1]" << endl;
+        return 1;
+    }
+    else if (locus_filter.min_minor_alleles < 0) {
+        cerr << "--min-minor-alleles must be at least 0" << endl;
+        return 1;
+    }
+    GenotypeMatrix::Layout layout = (genotype_layout == "locus") ? GenotypeMatrix::LOCUS_MAJOR
+                                                                 : GenotypeMatrix::INDIVIDUAL_MAJOR;
+    SmootherPlan::Solver solver = (smoother_solver == "cg") ? SmootherPlan::CONJUGATE_GRADIENT
+                                                            : SmootherPlan::NEWTON;
 
     // initialize random number generator
     mt19937 gen(random_seed);
-    std_vector3<short> *snps = new std_vector3<short>;
+    GenotypeMatrix *snps = new GenotypeMatrix;
+
+    InputSelection selection;
+    if (loci_file != "")
+        selection.loci = read_locus_selection(loci_file);
+    if (samples_file != "") {
+        vector<string> sample_ids;
+        if (ind_file != "")
+            sample_ids = read_sample_ids(ind_file, 0);
+        else if (bed_file != "")
+            sample_ids = read_sample_ids(plink_prefix(bed_file) + ".fam", 1);
+        else if (vcf_file != "")
+            sample_ids = read_vcf_sample_ids(vcf_file);
+        selection.samples = read_sample_selection(samples_file, sample_ids);
+    }
 
     vector<int> gen_sampled;
-    map<int, pair<int, int> > sample_map = read_snp_matrix(in_file, in_gen_times_file, snps, gen_sampled, nloci);
+    SampleTable samples;
+    if (cache_file != "")
+        samples = read_cache(cache_file, snps, gen_sampled, nloci);
+    else if (bed_file != "")
+        samples = read_bed_matrix(bed_file, in_gen_times_file, snps, gen_sampled, nloci, layout, selection,
+                                  time_binning);
+    else if (vcf_file != "")
+        samples = read_vcf_matrix(vcf_file, in_gen_times_file, snps, gen_sampled, nloci, layout, selection,
+                                  time_binning);
+    else
+        samples = read_snp_matrix(in_file, in_gen_times_file, snps, gen_sampled, nloci, layout, selection,
+                                  time_binning);
+    if (write_cache_file != "")
+        write_cache(write_cache_file, *snps, gen_sampled, samples);
+
+    LocusPositions positions;
+    if (snp_file != "")
+        positions = read_locus_positions(snp_file, selection.loci, nloci);
+    if (locus_filter.active()) {
+        vector<size_t> kept = filter_loci(snps, locus_filter, pseudo_haploid, nloci);
+        if (snp_file != "")
+            positions = select_positions(positions, kept);
+        // the kept loci as locus numbers of the input file
+        for (size_t i = 0; i < kept.size() && !selection.loci.empty(); ++i)
+            kept[i] = selection.loci[kept[i]];
+        write_locus_map(out_file + "_loci", kept);
+    }
+    vector<size_t> merged;
+    if (merge_duplicates)
+        merged = merge_duplicate_loci(snps, nloci);
+
     if (hold_out_fraction > 0)
         cout << "constructing hold out set..." << endl;
-    SNPData snp_data(snps, gen_sampled, hold_out_fraction, hold_out_seed, pseudo_haploid);
+    SNPData snp_data(snps, gen_sampled, hold_out_fraction, hold_out_seed, pseudo_haploid, sparse_threshold);
+    snp_data.set_positions(positions);
+    if (merge_duplicates)
+        snp_data.set_merged_loci(merged);
     vector2<int> labels(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()]);
     bool use_labels = false;
     if (label_file != "") {
-        labels = read_pop_labels(label_file, snp_data);
+        labels = read_pop_labels(label_file, snp_data, samples);
         use_labels = true;
     }
 
@@ -254,7 +502,8 @@ int main(int argc, char* const argv[])
     }
 
     //cout << "initializing variational parameters..." << endl;
-    SVI svi(npop, theta_prior, pop_size, snp_data, gen, nloci, epochs, sample_map, labels, multi_init, use_labels);
+    SVI svi(npop, theta_prior, pop_size, snp_data, gen, nloci, epochs, samples, labels, multi_init, use_labels,
+            scratch_dir, solver);
 
     //cout << "running..." << endl;
     svi.run_stochastic();
@@ -0,0 +1,108 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mapped_file.h"
+
+using std::cerr;
+using std::endl;
+using std::exit;
+using std::string;
+using std::vector;
+
+MappedFile::MappedFile(string fname) : addr(NULL), length(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "cannot open " << fname << endl;
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        cerr << "cannot open " << fname << endl;
+        exit(1);
+    }
+    length = st.st_size;
+
+    // mmap refuses zero length mappings; an empty file is left unmapped
+    if (length > 0) {
+        void* p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            cerr << "cannot map " << fname << " into memory" << endl;
+            exit(1);
+        }
+        addr = (const char*)p;
+    }
+    close(fd);
+}
+
+
+
+MappedFile::~MappedFile()
+{
+    if (addr != NULL)
+        munmap((void*)addr, length);
+}
+
+
+
+ScratchFile::ScratchFile(string dir, size_t size) : addr(NULL), length(size)
+{
+    string fname = dir + "/dystruct-scratch-XXXXXX";
+    vector<char> path(fname.begin(), fname.end());
+    path.push_back('\0');
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        cerr << "cannot create a scratch file in " << dir << endl;
+        exit(1);
+    }
+    unlink(&path[0]);
+
+    if (ftruncate(fd, length) != 0) {
+        cerr << "cannot allocate " << length << " bytes in " << dir << endl;
+        exit(1);
+    }
+
+    if (length > 0) {
+        void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            cerr << "cannot map a scratch file in " << dir << " into memory" << endl;
+            exit(1);
+        }
+        addr = (char*)p;
+    }
+    close(fd);
+}
+
+
+
+ScratchFile::~ScratchFile()
+{
+    if (addr != NULL)
+        munmap(addr, length);
+}
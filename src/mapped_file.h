@@ -0,0 +1,70 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// A read-only memory mapping of an entire file. Pages are loaded by the
+// kernel on first access, so input files can be parsed in place without
+// copying them into memory first.
+class MappedFile
+{
+    public:
+        MappedFile(std::string fname);
+        ~MappedFile();
+
+        const char* data() const                                          { return addr; }
+        size_t      size() const                                          { return length; }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        const char* addr;
+        size_t      length;
+};
+
+
+
+// A writable memory mapping of a temporary file of a fixed size, initially
+// zero. The file is removed as soon as it is created, so its disk space is
+// returned when the mapping is released. Pages that are not in use can be
+// written back to the file and dropped by the kernel, so the mapping does
+// not have to fit in memory.
+class ScratchFile
+{
+    public:
+        ScratchFile(std::string dir, size_t size);
+        ~ScratchFile();
+
+        char*       data()                                                { return addr; }
+        size_t      size() const                                          { return length; }
+
+    private:
+        ScratchFile(const ScratchFile&);
+        ScratchFile& operator=(const ScratchFile&);
+
+        char*       addr;
+        size_t      length;
+};
+
+#endif
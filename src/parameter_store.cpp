@@ -0,0 +1,36 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parameter_store.h"
+
+using std::vector;
+
+double* ParameterStore::allocate(size_t n)
+{
+    if (!out_of_core()) {
+        heap.push_back(vector<double>(n, 0));
+        return heap.back().data();
+    }
+    files.push_back(std::unique_ptr<ScratchFile>(new ScratchFile(scratch_dir, n*sizeof(double))));
+    return (double*)files.back()->data();
+}
@@ -0,0 +1,67 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARAMETER_STORE_H
+#define PARAMETER_STORE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "vector_types.h"
+
+// Allocates arrays of variational parameters. Arrays are kept in memory by
+// default. Given a scratch directory, each array is a scratch file in that
+// directory mapped into memory instead, so arrays larger than memory can be
+// used as long as they are accessed with some locality.
+class ParameterStore
+{
+    public:
+        ParameterStore(std::string scratch_dir = "") : scratch_dir(scratch_dir) { }
+
+        bool        out_of_core() const                                   { return scratch_dir != ""; }
+        std::string directory() const                                     { return scratch_dir; }
+
+        // returns n doubles, initially zero, that live as long as the store
+        double* allocate(size_t n);
+
+        // returns a copy of an array with the same shape and storage order
+        template <typename T, size_t N>
+        boost::multi_array_ref<T, N> copy(const boost::multi_array_ref<T, N>& a)
+        {
+            boost::multi_array_ref<T, N> c(allocate(a.num_elements()),
+                                           std::vector<size_t>(a.shape(), a.shape() + N),
+                                           a.storage_order());
+            std::copy(a.data(), a.data() + a.num_elements(), c.data());
+            return c;
+        }
+
+    private:
+        ParameterStore(const ParameterStore&);
+        ParameterStore& operator=(const ParameterStore&);
+
+        std::string                                 scratch_dir;
+        std::vector<std::vector<double> >           heap;
+        std::vector<std::unique_ptr<ScratchFile> >  files;
+};
+
+#endif
@@ -0,0 +1,48 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAMPLE_TABLE_H
+#define SAMPLE_TABLE_H
+
+#include <cstddef>
+#include <vector>
+
+// The loaded samples, numbered in input order, with the time step and
+// individual of each. The table is built once while loading and then only
+// read by the output writers and the population label reader.
+class SampleTable
+{
+    public:
+        // adds the next sample, which is individual indiv at time step time
+        void   add(int time, int indiv)
+        {
+            sample_time.push_back(time);
+            sample_indiv.push_back(indiv);
+        }
+
+        size_t size() const                                               { return sample_time.size(); }
+        int    time(size_t sample) const                                  { return sample_time[sample]; }
+        int    individual(size_t sample) const                            { return sample_indiv[sample]; }
+
+    private:
+        std::vector<int>    sample_time;    // sample_time[i] is the time step of sample i
+        std::vector<int>    sample_indiv;   // sample_indiv[i] is the individual number of sample i at its time step
+};
+
+#endif
@@ -20,19 +20,17 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
 #include <cassert>
-#include <map>
-#include <set>
+#include <iomanip>
 #include <vector>
 #include "snp_data.h"
 
 #include <iostream>
 
-using std::pair;
-using std::map;
 using std::vector;
 
-SNPData::SNPData(const std_vector3<short> *snps, vector<int> sample_gen, double hold_out_proportion, int hold_out_seed, bool pseudo_haploid)
-    : sample_gen(sample_gen)
+SNPData::SNPData(GenotypeMatrix *snps, vector<int> sample_gen, double hold_out_proportion, int hold_out_seed, bool pseudo_haploid,
+                 double sparse_threshold)
+    : sample_gen(sample_gen), is_sparse(false)
 {
     // fixing the random seed will fix the hold out set across runs
     // so that the held-out log likelihood can be compared
@@ -41,16 +39,14 @@ SNPData::SNPData(const std_vector3<short> *snps, vector<int> sample_gen, double
 
     // select hold_out_proportion SNP locations to put into a hold out set.
     // at each selected location, a genotype of a single individual is
-    // held out.
-    int total_individuals = 0;
-    for (size_t t = 0; t < (*snps).size(); ++t)
-        total_individuals += (*snps)[t].size();
-
-    size_t nloci = (*snps)[0][0].size();
+    // held out, so the hold out set is stored as the row index of that
+    // individual at each locus.
+    size_t nloci = snps->total_loci();
     int nlocations = nloci * hold_out_proportion;
-    std::set<int> picked;
+    ho_row.assign(nloci, -1);
+    ho_code.assign(nloci, GenotypeMatrix::MISSING);
     boost::random::uniform_int_distribution<int> ldist(0, nloci - 1);
-    boost::random::uniform_int_distribution<int> tdist(0, (*snps).size() - 1);
+    boost::random::uniform_int_distribution<int> tdist(0, total_time_steps() - 1);
 
     int count = 0;
     for (int i = 0; i < nlocations; ++i) {
@@ -62,44 +58,155 @@ SNPData::SNPData(const std_vector3<short> *snps, vector<int> sample_gen, double
         int t = tdist(gen);;
 
         // pick an individual
-        boost::random::uniform_int_distribution<int> idist(0, (*snps)[t].size() - 1);
+        boost::random::uniform_int_distribution<int> idist(0, total_individuals(t) - 1);
         int individual = idist(gen);
 
         // make sure we have data and that we have not already picked this locus
-        while (missing(t, individual, draw) or picked.find(draw) != picked.end()) {
+        while (missing(t, individual, draw) or ho_row[draw] != -1) {
             t = tdist(gen);
-            boost::random::uniform_int_distribution<int> idist(0, (*snps)[t].size() - 1);
+            boost::random::uniform_int_distribution<int> idist(0, total_individuals(t) - 1);
             individual = idist(gen);
             draw = ldist(gen);
         }
-        picked.insert(draw);
-
-        if (ho.find(t) == ho.end()) {
-            ho[t] = vector<vector<int> >();
-            for (size_t d = 0; d < (*snps)[t].size(); ++d) {
-                ho[t].push_back(vector<int>());
-            }
-        }
-        ho[t][individual].push_back(draw);
+        ho_row[draw] = snps->row_index(t, individual);
+        ho_code[draw] = snps->code(t, individual, draw);
         count += 1;
     }
+    nheld_out = count;
 
     // check
     assert(count == nlocations);
 
-    // check if individual is hemizygous / pseudo haploid
-    for (size_t t = 0; t < (*snps).size(); ++t) {
+    // check if individual is hemizygous / pseudo haploid: an individual is
+    // hemizygous if none of its genotypes are heterozygous
+    vector<bool> heterozygous = snps->heterozygous_rows();
+    for (size_t t = 0; t < total_time_steps(); ++t) {
         hemi.push_back(vector<bool>());
-        for (size_t d = 0; d < (*snps)[t].size(); ++d) {
-            bool is_hemizygous = pseudo_haploid;
-            for (size_t l = 0; l <  (*snps)[t][d].size(); ++l) {
-                if ((*snps)[t][d][l] == 1) {
-                    is_hemizygous = false;
-                }
+        for (size_t d = 0; d < total_individuals(t); ++d) {
+            hemi[t].push_back(pseudo_haploid && !heterozygous[snps->row_index(t, d)]);
+        }
+    }
+
+    row_time.resize(snps->total_rows());
+    for (size_t t = 0; t < total_time_steps(); ++t) {
+        for (size_t d = 0; d < total_individuals(t); ++d) {
+            row_time[snps->row_index(t, d)] = t;
+        }
+    }
+
+    // every observed genotype is either in the index or held out, so the
+    // dense matrix is redundant once the index is built. It is dropped when
+    // coverage is low, where it makes up most of the memory, at the cost of a
+    // binary search for random lookups. Otherwise the index is not built, and
+    // the observed genotypes at a locus are decoded from the matrix.
+    double nentries = (double)snps->total_rows()*nloci;
+    double missing_fraction = 1 - (count_observed() + nheld_out) / nentries;
+    if (missing_fraction >= sparse_threshold) {
+        std::cout << "\tusing sparse genotype storage (" << std::setprecision(3) << 100*missing_fraction
+                  << "% missing)..." << std::endl;
+        is_sparse = true;
+        index_observed();
+        snps->release_codes();
+    }
+    else {
+        vector<size_t>().swap(obs_offset);
+    }
+}
+
+
+
+void SNPData::set_merged_loci(const vector<size_t>& merged)
+{
+    this->merged = merged;
+    weights.assign(snps->total_loci(), 0);
+    first_loaded.assign(snps->total_loci(), 0);
+    for (size_t j = merged.size(); j-- > 0; ) {
+        weights[merged[j]]++;
+        first_loaded[merged[j]] = j;
+    }
+}
+
+
+
+// Counts the observed genotypes at each locus into obs_offset, as the offsets
+// of the loci in the index of observed genotypes. Returns the total.
+size_t SNPData::count_observed()
+{
+    size_t nloci = snps->total_loci();
+    size_t nrows = snps->total_rows();
+
+    obs_offset.assign(nloci + 1, 0);
+    #pragma omp parallel
+    {
+        vector<unsigned char> codes(nrows);
+        #pragma omp for schedule(static)
+        for (size_t l = 0; l < nloci; ++l) {
+            snps->locus_codes(l, &codes[0]);
+            size_t count = 0;
+            for (size_t i = 0; i < nrows; ++i) {
+                count += (codes[i] != GenotypeMatrix::MISSING);
             }
-            hemi[t].push_back(is_hemizygous);
+            if (ho_row[l] != -1)
+                count--;
+            obs_offset[l + 1] = count;
         }
     }
+
+    for (size_t l = 0; l < nloci; ++l) {
+        obs_offset[l + 1] += obs_offset[l];
+    }
+    return obs_offset[nloci];
+}
+
+
+
+// Builds a compressed list of the observed genotypes at each locus, at the
+// offsets from count_observed, so the dense matrix can be dropped.
+void SNPData::index_observed()
+{
+    size_t nloci = snps->total_loci();
+    size_t nrows = snps->total_rows();
+
+    obs.resize(obs_offset[nloci]);
+    #pragma omp parallel
+    {
+        vector<unsigned char> codes(nrows);
+        #pragma omp for schedule(static)
+        for (size_t l = 0; l < nloci; ++l) {
+            snps->locus_codes(l, &codes[0]);
+            size_t j = obs_offset[l];
+            for (size_t i = 0; i < nrows; ++i) {
+                if (codes[i] == GenotypeMatrix::MISSING || (int)i == ho_row[l]) continue;
+                obs[j++] = (uint32_t)(i << 2) | codes[i];
+            }
+        }
+    }
+}
+
+
+
+void SNPData::observed_genotypes(size_t locus, LocusGenotypes& observed) const
+{
+    observed.locus_id = (long)locus;
+    observed.row_time = row_time.data();
+    observed.snps = snps;
+    if (is_sparse) {
+        observed.entries = obs.data() + obs_offset[locus];
+        observed.nentries = obs_offset[locus + 1] - obs_offset[locus];
+        return;
+    }
+
+    // the buffers keep their capacity, so only the first loci allocate
+    size_t nrows = snps->total_rows();
+    observed.codes.resize(nrows);
+    observed.decoded.clear();
+    snps->locus_codes(locus, observed.codes.data());
+    for (size_t i = 0; i < nrows; ++i) {
+        if (observed.codes[i] == GenotypeMatrix::MISSING || (int)i == ho_row[locus]) continue;
+        observed.decoded.push_back((uint32_t)(i << 2) | observed.codes[i]);
+    }
+    observed.entries = observed.decoded.data();
+    observed.nentries = observed.decoded.size();
 }
 
 
@@ -108,8 +215,24 @@ int SNPData::max_individuals() const
 {
     int max = 0;
     for (size_t t = 0; t < total_time_steps(); ++t) {
-        if ((int)(*snps)[t].size() > max)
-            max = (int)(*snps)[t].size();
+        if ((int)total_individuals(t) > max)
+            max = (int)total_individuals(t);
     }
     return max;
-}
\ No newline at end of file
+}
+
+
+
+int SNPData::sparse_code(size_t row, size_t locus) const
+{
+    if (ho_row[locus] == (int)row)
+        return ho_code[locus];
+
+    // entries at a locus are sorted by row
+    const uint32_t* begin = &obs[0] + obs_offset[locus];
+    const uint32_t* end = &obs[0] + obs_offset[locus + 1];
+    const uint32_t* it = std::lower_bound(begin, end, (uint32_t)(row << 2));
+    if (it != end && (*it >> 2) == row)
+        return *it & 3;
+    return GenotypeMatrix::MISSING;
+}
@@ -22,58 +22,151 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
 #include <boost/random/mersenne_twister.hpp>
+#include <cstdint>
 #include <map>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "genotype_matrix.h"
 #include "vector_types.h"
 
 #include <iostream>
 
 
+// Genomic positions of the loci, in the order of the genotype matrix.
+struct LocusPositions
+{
+    std::vector<std::string>    ids;                // ids[l] is the name of locus l
+    std::vector<std::string>    chromosome_names;   // in order of first appearance
+    std::vector<int>            chromosome;         // chromosome[l] indexes the chromosome name of locus l
+    std::vector<long>           position;           // position[l] is the physical position of locus l
+};
+
+
+class SNPData;
+
+// The observed (not hidden) genotypes at one locus, in order of time step and
+// then individual, as filled in by SNPData::observed_genotypes. One object is
+// reused from locus to locus, so it cannot be copied.
+class LocusGenotypes
+{
+    public:
+        LocusGenotypes() : locus_id(-1), entries(NULL), nentries(0), row_time(NULL), snps(NULL) { };
+
+        // the locus held, or -1 before the first is filled in
+        long   locus() const                                              { return locus_id; }
+        size_t size() const                                               { return nentries; }
+        size_t time(size_t i) const                                       { return row_time[entries[i] >> 2]; }
+        size_t indiv(size_t i) const                                      { return (entries[i] >> 2) - snps->row_index(time(i), 0); }
+        double genotype(size_t i) const                                   { return (double)(entries[i] & 3); }
+
+    private:
+        friend class SNPData;
+
+        long                                    locus_id;
+        const uint32_t                          *entries;      // row index << 2 | genotype code of each observed genotype
+        size_t                                  nentries;
+        std::vector<uint32_t>                   decoded;       // the entries, when decoded from the dense matrix
+        std::vector<unsigned char>              codes;         // every code at the locus, while decoding
+        const int                               *row_time;     // row_time[i] is the time step of the individual with row index i
+        const GenotypeMatrix                    *snps;
+
+        LocusGenotypes(const LocusGenotypes&);
+        LocusGenotypes& operator=(const LocusGenotypes&);
+};
+
+
 class SNPData
 {
     public:
-        SNPData() { };
-        SNPData(SNPData& d) : ho(d.ho), sample_gen(d.sample_gen), hemi(d.hemi) { this->snps = d.snps; }
-        SNPData(const std_vector3<short> *snps, std::vector<int> sample_gen, double hold_out_proportion, int hold_out_seed, bool pseudo_haploid );
-        size_t total_time_steps() const                                   { return (*snps).size(); }
-        size_t total_individuals(size_t time) const                       { return (*snps)[time].size(); }
+        SNPData() : nheld_out(0), is_sparse(false) { };
+        // If at least a sparse_threshold fraction of genotypes is missing, the
+        // observed genotypes are indexed and the codes in snps are freed, and
+        // genotypes are looked up in the index instead.
+        SNPData(GenotypeMatrix *snps, std::vector<int> sample_gen, double hold_out_proportion, int hold_out_seed, bool pseudo_haploid,
+                double sparse_threshold);
+        size_t total_time_steps() const                                   { return snps->total_time_steps(); }
+        size_t total_individuals(size_t time) const                       { return snps->total_individuals(time); }
         // total loci for individual indiv sampled at time t
-        size_t total_loci(size_t time, size_t indiv) const                { return (*snps)[time][indiv].size(); }
+        size_t total_loci(size_t time, size_t indiv) const                { return snps->total_loci(); }
         int    get_sample_gen(size_t time) const                          { return sample_gen[time]; }
         int    max_individuals() const;
 
+        // only meaningful for nonmissing entries
         double genotype(size_t time, size_t indiv, size_t locus) const
         { 
-            return (double)(*snps)[time][indiv][locus];
+            return (double)code(time, indiv, locus);
         }
 
         bool   missing(size_t time, size_t indiv, size_t locus) const
         {
-            return (*snps)[time][indiv][locus] == (short)9;
+            return code(time, indiv, locus) == GenotypeMatrix::MISSING;
         }
 
+        // true if genotypes are only stored in the index of observed genotypes
+        bool   sparse() const                                             { return is_sparse; }
+
+        // the packed genotype codes, for word level access. Empty if sparse().
+        const GenotypeMatrix& genotypes() const                           { return *snps; }
+
         bool   hold_out(int time, size_t indiv, int locus) const
         {
-            if (ho.find(time) == ho.end())
-                return false;
-            else 
-                return (find(ho.at(time)[indiv].begin(), ho.at(time)[indiv].end(), locus) != ho.at(time)[indiv].end());
+            return ho_row[locus] == (int)snps->row_index(time, indiv);
         }
 
         bool   hidden(size_t time, size_t indiv, size_t locus) const      { return (missing(time, indiv, locus) || hold_out(time, indiv, locus)); }
 
         bool   hemizygous(size_t time, size_t indiv) const  { return hemi[time][indiv]; }
 
-        bool   has_hold_out() { return ho.size() != 0; }
+        bool   has_hold_out() const { return nheld_out != 0; }
+
+        // fills in the observed genotypes at locus, from the index of observed
+        // genotypes if sparse() and otherwise from the dense matrix
+        void   observed_genotypes(size_t locus, LocusGenotypes& observed) const;
+
+        // Loci with identical genotypes can be merged into a single locus of
+        // the matrix. Loaded locus j is held by locus merged_locus(j), and
+        // weight(l) is the number of loaded loci merged into locus l.
+        void   set_merged_loci(const std::vector<size_t>& merged);
+        size_t total_loaded_loci() const                                  { return merged.empty() ? snps->total_loci() : merged.size(); }
+        size_t merged_locus(size_t loaded) const                          { return merged.empty() ? loaded : merged[loaded]; }
+        double weight(size_t locus) const                                 { return weights.empty() ? 1 : weights[locus]; }
+
+        // chromosomes and positions of the loaded loci, if they were given. A
+        // merged locus takes the chromosome of the first loaded locus it holds.
+        void   set_positions(const LocusPositions& positions)             { this->positions = positions; }
+        bool   has_positions() const                                      { return !positions.chromosome.empty(); }
+        const LocusPositions& locus_positions() const                     { return positions; }
+        int    chromosome(size_t locus) const                             { return positions.chromosome[first_loaded.empty() ? locus : first_loaded[locus]]; }
+        size_t total_chromosomes() const                                  { return positions.chromosome_names.size(); }
 
     private:
-        typedef std::vector<std::vector<int> >  matrix;
-        const std_vector3<short>                *snps;         // the full SNP data set
-        std::map<int, matrix>                   ho;            // 
+        const GenotypeMatrix                    *snps;         // the full SNP data set
+        std::vector<int>                        ho_row;        // ho_row[l] is the row index of the individual held out at locus l, or -1
+        std::vector<unsigned char>              ho_code;       // ho_code[l] is the genotype code held out at locus l
+        int                                     nheld_out;     // number of held out genotypes
         std::vector<int>                        sample_gen;    // sample_gen[t] gives the generation number corresponding to time step t.
         std::vector<std::vector<bool> >         hemi;          // hemi[t][d] is true if individual is hemizygous
+        std::vector<size_t>                     obs_offset;    // observed genotypes at locus l are obs[obs_offset[l]] to obs[obs_offset[l+1] - 1], if sparse
+        std::vector<uint32_t>                   obs;           // row index << 2 | genotype code of each observed genotype, if sparse
+        std::vector<int>                        row_time;      // row_time[i] is the time step of the individual with row index i
+        bool                                    is_sparse;
+        LocusPositions                          positions;     // empty unless set_positions() was called
+        std::vector<size_t>                     merged;        // merged[j] is the locus holding loaded locus j, empty if no loci were merged
+        std::vector<int>                        weights;       // weights[l] is the number of loaded loci merged into locus l
+        std::vector<size_t>                     first_loaded;  // first_loaded[l] is the first loaded locus merged into locus l
+
+        size_t count_observed();
+        void index_observed();
+        int  sparse_code(size_t row, size_t locus) const;
+
+        int  code(size_t time, size_t indiv, size_t locus) const
+        {
+            if (is_sparse)
+                return sparse_code(snps->row_index(time, indiv), locus);
+            return snps->code(time, indiv, locus);
+        }
 };
 
 #endif
\ No newline at end of file
@@ -36,7 +36,6 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <ios>
 #include <iostream>
-#include <map>
 #include <iomanip>
 #include <utility>
 
@@ -69,7 +68,6 @@ using std::endl;
 using std::fixed;
 using std::flush;
 using std::ios;
-using std::map;
 using std::max;
 using std::min;
 using std::ofstream;
@@ -84,36 +82,54 @@ using std::vector;
 SVI::SVI(int                       npops,
          vector<double>            mixture_prior,
          double                    pop_size,
-         SNPData                   snp_data,
+         const SNPData&            snp_data,
          boost::random::mt19937&   gen,
          size_t                    nloci,
          int                       nepochs,
-         map<int,pair<int, int> >  sample_map,
+         const SampleTable&        samples,
          vector2<int>              labels,
          bool                      multi_init,
-         bool                      using_labels) :
+         bool                      using_labels,
+         string                    scratch_dir,
+         SmootherPlan::Solver      smoother_solver) :
          npops(npops),
          nloci(nloci),
          nsteps(snp_data.total_time_steps()),
-         initial_freq(boost::extents[npops][nloci]),
-         freqs(boost::extents[snp_data.total_time_steps()][npops][nloci][2]),
-         pseudo_outputs(boost::extents[npops][nloci][snp_data.total_time_steps()]),
+         snp_data(snp_data),
+         smoother_plan(snp_data, pop_size, smoother_solver),
+         smoothers(npops, VariationalKalmanSmoother(smoother_plan)),
+         store(scratch_dir),
+         initial_freq(store.allocate(npops*nloci), boost::extents[npops][nloci],
+                      slowest_varying<2>(1)),
+         freqs(store.allocate(snp_data.total_time_steps()*npops*nloci*2), boost::extents[snp_data.total_time_steps()][npops][nloci][2],
+               slowest_varying<4>(2)),
+         pseudo_outputs(store.allocate(npops*nloci*snp_data.total_time_steps()), boost::extents[npops][nloci][snp_data.total_time_steps()],
+                        slowest_varying<3>(1)),
          phi(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()][npops]),
          zeta(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()][npops]),
          theta(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()][npops]),
          nloci_indv(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()]),
          sample_iter(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()]),
          nepochs(nepochs),
-         sample_map(sample_map),
+         samples(samples),
          multi_init(multi_init),
          labels(labels)
 {   
     this->mixture_prior = mixture_prior;
     this->pop_size = pop_size;
-    this->snp_data = snp_data;
     this->gen = gen;
     this->using_labels = using_labels;
 
+    // about 1MB of allele frequency parameters per block. If the positions
+    // of the loci are known, blocks do not span chromosomes.
+    size_t locus_block = max((size_t)1, (size_t)(1 << 20) / (nsteps*npops*2*sizeof(double)));
+    for (size_t l = 0; l < nloci; ++l) {
+        bool new_chromosome = snp_data.has_positions() && l > 0 && snp_data.chromosome(l) != snp_data.chromosome(l - 1);
+        if (l == 0 || l - block_start.back() == locus_block || new_chromosome)
+            block_start.push_back(l);
+    }
+    block_start.push_back(nloci);
+
     initialize_variational_parameters();
 }
 
@@ -126,11 +142,13 @@ void SVI::initialize_variational_parameters()
         nindv += snp_data.total_individuals(t);
         for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
             nloci_indv[t][d] = 0;
-            for (size_t l = 0; l < nloci; ++l) {
-                if (!snp_data.hidden(t, d, l))
-                    nloci_indv[t][d] += 1;
-                sample_iter[t][d] = 0;
-            }
+            sample_iter[t][d] = 0;
+        }
+    }
+    for (size_t l = 0; l < nloci; ++l) {
+        const LocusGenotypes& genotypes = observed_at(l);
+        for (size_t i = 0; i < genotypes.size(); ++i) {
+            nloci_indv[genotypes.time(i)][genotypes.indiv(i)] += 1;
         }
     }
 
@@ -142,14 +160,19 @@ void SVI::initialize_variational_parameters()
         }
     }
 
-    for (size_t t = 0; t < nsteps; ++t) {
+    // the per-locus parameters are stored locus by locus, so loci are the
+    // outer loop here
+    for (size_t l = 0; l < nloci; ++l) {
         for (size_t k = 0; k < npops; ++k) {
-            for (size_t l = 0; l < nloci; ++l) {
+            for (size_t t = 0; t < nsteps; ++t) {
                 freqs[t][k][l][0] = initial_freq[k][l];
                 freqs[t][k][l][1] = 1.0/(12*pop_size);
+                pseudo_outputs[k][l][t] = initial_freq[k][l];
             }
         }
+    }
 
+    for (size_t t = 0; t < nsteps; ++t) {
         for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
             gamma_distribution<double> gamma(10, 10);
             for (size_t k = 0; k < npops; ++k) {
@@ -166,15 +189,6 @@ void SVI::initialize_variational_parameters()
             }
         }
     }
-
-    // initialize pseudo-outputs
-    for (size_t k = 0; k < npops; ++k) {
-        for (size_t l = 0; l < nloci; ++l) {
-            for (size_t t = 0; t < nsteps; ++t) {
-                pseudo_outputs[k][l][t] = initial_freq[k][l];
-            }
-        }
-    }
 }
 
 
@@ -201,6 +215,11 @@ double SVI::compute_objective()
         load_auxiliary_parameters(l);
         update_allele_frequencies(l);
 
+        // a merged locus stands for weight(l) loci with the same genotypes
+        double locus_elbo = 0;
+
+        const LocusGenotypes& genotypes = observed_at(l);
+        size_t i = 0;
         for (size_t t = 0; t < nsteps; ++t) {
             // E[log p(beta^t | beta^t-1)] - E[log q(beta^t | beta^t-1)] 
             for (size_t k = 0; k < npops; ++k) {
@@ -212,45 +231,44 @@ double SVI::compute_objective()
                     m0 = freqs[t-1][k][l][0];
                     v0 = freqs[t-1][k][l][1];
                 }
-                elbo += -(0.5/var[t])*pow(freqs[t][k][l][0] - m0, 2) - 0.5*freqs[t][k][l][1]/var[t] - 0.5*v0/var[t];
-                elbo += 0.5*log(freqs[t][k][l][1]);
+                locus_elbo += -(0.5/var[t])*pow(freqs[t][k][l][0] - m0, 2) - 0.5*freqs[t][k][l][1]/var[t] - 0.5*v0/var[t];
+                locus_elbo += 0.5*log(freqs[t][k][l][1]);
             }
 
             // E[log p(x | beta, theta)]
-            for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
+            for (; i < genotypes.size() && genotypes.time(i) == t; ++i) {
+                size_t d = genotypes.indiv(i);
+                double x = genotypes.genotype(i);
                 double sum_theta = 0;
                 for (size_t k = 0; k < npops; ++k) {
                     sum_theta += theta[t][d][k];
                 }
 
                 for (size_t k = 0; k < npops; ++k) {
-                    if (snp_data.hidden(t, d, l)) continue;
-
-                    double x = snp_data.genotype(t, d, l);
-
                     if (snp_data.hemizygous(t, d)) {
-                        elbo += 0.5*x*( digamma(theta[t][d][k]) - digamma(sum_theta) 
-                                    + log(freqs[t][k][l][0]) - 0.5*freqs[t][k][l][1]/pow(freqs[t][k][l][0], 2) 
-                                    - log(phi[t][d][k])
-                                   )*phi[t][d][k];
-                        elbo += 0.5*(2-x)*( digamma(theta[t][d][k]) - digamma(sum_theta) 
-                                        + log(1 - freqs[t][k][l][0])
-                                        - log(zeta[t][d][k])
-                                      )*zeta[t][d][k];
+                        locus_elbo += 0.5*x*( digamma(theta[t][d][k]) - digamma(sum_theta) 
+                                          + log(freqs[t][k][l][0]) - 0.5*freqs[t][k][l][1]/pow(freqs[t][k][l][0], 2) 
+                                          - log(phi[t][d][k])
+                                         )*phi[t][d][k];
+                        locus_elbo += 0.5*(2-x)*( digamma(theta[t][d][k]) - digamma(sum_theta) 
+                                              + log(1 - freqs[t][k][l][0])
+                                              - log(zeta[t][d][k])
+                                            )*zeta[t][d][k];
                     }
                     else {
-                        elbo += x*( digamma(theta[t][d][k]) - digamma(sum_theta) 
-                                    + log(freqs[t][k][l][0]) - 0.5*freqs[t][k][l][1]/pow(freqs[t][k][l][0], 2) 
-                                    - log(phi[t][d][k])
-                                   )*phi[t][d][k];
-                        elbo += (2-x)*( digamma(theta[t][d][k]) - digamma(sum_theta) 
-                                        + log(1 - freqs[t][k][l][0])
-                                        - log(zeta[t][d][k])
-                                      )*zeta[t][d][k];
+                        locus_elbo += x*( digamma(theta[t][d][k]) - digamma(sum_theta) 
+                                          + log(freqs[t][k][l][0]) - 0.5*freqs[t][k][l][1]/pow(freqs[t][k][l][0], 2) 
+                                          - log(phi[t][d][k])
+                                         )*phi[t][d][k];
+                        locus_elbo += (2-x)*( digamma(theta[t][d][k]) - digamma(sum_theta) 
+                                              + log(1 - freqs[t][k][l][0])
+                                              - log(zeta[t][d][k])
+                                            )*zeta[t][d][k];
                     }
                 }
             }
         }
+        elbo += snp_data.weight(l)*locus_elbo;
     }
 
     // E[log p(theta)] - E[log q(theta)]
@@ -273,15 +291,18 @@ double SVI::compute_objective()
 }
 
 
-double SVI::compute_ho_log_likelihood()
+double SVI::compute_ho_log_likelihood(vector<double>* chromosome_log_lk)
 {
+    if (chromosome_log_lk != NULL)
+        chromosome_log_lk->assign(snp_data.total_chromosomes(), 0);
+
     double log_lk = 0;
     double p = 0;
     double s = 0;
 
-    for (size_t t = 0; t < nsteps; ++t) {
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            for (size_t l = 0; l < nloci; ++l) {
+    for (size_t l = 0; l < nloci; ++l) {
+        for (size_t t = 0; t < nsteps; ++t) {
+            for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
                 if (!snp_data.hold_out(t,d,l) || snp_data.missing(t,d,l)) continue;
                 
                 load_auxiliary_parameters(l);
@@ -298,13 +319,18 @@ double SVI::compute_ho_log_likelihood()
                 if (p >= 1) p = 0.999;
                 else if (p == 0) p = 0.001;
 
+                double lk;
                 if (snp_data.hemizygous(t, d)) {
-                    log_lk += 0.5*(snp_data.genotype(t,d,l)*log(p) + (2 - snp_data.genotype(t,d,l))*log(1-p));
+                    lk = 0.5*(snp_data.genotype(t,d,l)*log(p) + (2 - snp_data.genotype(t,d,l))*log(1-p));
                 }
                 else {
                     double m = max(snp_data.genotype(t,d,l), 2 - snp_data.genotype(t,d,l));
-                    log_lk += log(2.0) - log(m) + snp_data.genotype(t,d,l)*log(p) + (2 - snp_data.genotype(t,d,l))*log(1-p);
+                    lk = log(2.0) - log(m) + snp_data.genotype(t,d,l)*log(p) + (2 - snp_data.genotype(t,d,l))*log(1-p);
                 }
+                lk *= snp_data.weight(l);
+                log_lk += lk;
+                if (chromosome_log_lk != NULL)
+                    (*chromosome_log_lk)[snp_data.chromosome(l)] += lk;
             }
         }
     }
@@ -316,22 +342,22 @@ double SVI::compute_ho_log_likelihood()
 bool SVI::update_auxiliary_parameters(int sample)
 {
     bool converged = true;
-    for (size_t t = 0; t < nsteps; ++t) {
-        #pragma omp parallel for reduction(&&:converged)
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            if (snp_data.hidden(t,d,sample)) continue;
-            vector<double> prev_phi(npops);
-            vector<double> prev_zeta(npops);
-            
-            for (size_t k = 0; k < npops; ++k) {
-                prev_phi[k] = phi[t][d][k];
-                prev_zeta[k] = zeta[t][d][k];
-            }
-            update_auxiliary_local(t,d,sample);
-            
-            for (size_t k = 0; k < npops; ++k) {
-                converged = (abs(prev_zeta[k] - zeta[t][d][k]) < 0.001) && (abs(prev_phi[k] - phi[t][d][k]) < 0.001) && converged;
-            }
+    const LocusGenotypes& genotypes = observed_at(sample);
+    #pragma omp parallel for reduction(&&:converged)
+    for (size_t i = 0; i < genotypes.size(); ++i) {
+        size_t t = genotypes.time(i);
+        size_t d = genotypes.indiv(i);
+        vector<double> prev_phi(npops);
+        vector<double> prev_zeta(npops);
+        
+        for (size_t k = 0; k < npops; ++k) {
+            prev_phi[k] = phi[t][d][k];
+            prev_zeta[k] = zeta[t][d][k];
+        }
+        update_auxiliary_local(t,d,sample);
+        
+        for (size_t k = 0; k < npops; ++k) {
+            converged = (abs(prev_zeta[k] - zeta[t][d][k]) < 0.001) && (abs(prev_phi[k] - phi[t][d][k]) < 0.001) && converged;
         }
     }
     return converged;
@@ -341,16 +367,24 @@ bool SVI::update_auxiliary_parameters(int sample)
 
 void SVI::load_auxiliary_parameters(int sample)
 {
-    for (size_t t = 0; t < nsteps; ++t) {
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            if (snp_data.hidden(t,d,sample)) continue;
-            update_auxiliary_local(t,d,sample);
-        }
+    const LocusGenotypes& genotypes = observed_at(sample);
+    for (size_t i = 0; i < genotypes.size(); ++i) {
+        update_auxiliary_local(genotypes.time(i), genotypes.indiv(i), sample);
     }
 }
 
 
 
+// The observed genotypes at locus, decoded once while SVI stays at the locus.
+const LocusGenotypes& SVI::observed_at(size_t locus)
+{
+    if (observed.locus() != (long)locus)
+        snp_data.observed_genotypes(locus, observed);
+    return observed;
+}
+
+
+
 void SVI::update_auxiliary_local(size_t t, size_t d, size_t l)
 {
     double dgma = 0.0;
@@ -406,9 +440,11 @@ void SVI::update_auxiliary_local(size_t t, size_t d, size_t l)
 
 void SVI::update_allele_frequencies(int locus)
 {
+    const LocusGenotypes& genotypes = observed_at(locus);
     #pragma omp parallel for
     for (size_t k = 0; k < npops; ++k) {
-        VariationalKalmanSmoother vks = VariationalKalmanSmoother(snp_data, pseudo_outputs, initial_freq[k][locus], phi, zeta, pop_size, k, locus);
+        VariationalKalmanSmoother& vks = smoothers[k];
+        vks.reset(snp_data, genotypes, pseudo_outputs, initial_freq[k][locus], phi, zeta, k, locus);
         vks.maximize_pseudo_outputs();
         vks.set_marginals(freqs, k, locus);
         vks.set_outputs(pseudo_outputs);
@@ -420,32 +456,32 @@ void SVI::update_allele_frequencies(int locus)
 
 void SVI::update_mixture_proportions(int locus)
 {
-    int l = locus;
     double step_size;
-    for (size_t t = 0; t < nsteps; ++ t) {
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            if (snp_data.hidden(t, d, l)) continue;
-            else sample_iter[t][d]++;
-            for (size_t k = 0; k < npops; ++k) {
-                double update = 0;
+    const LocusGenotypes& genotypes = observed_at(locus);
+    for (size_t i = 0; i < genotypes.size(); ++i) {
+        size_t t = genotypes.time(i);
+        size_t d = genotypes.indiv(i);
+        double x = genotypes.genotype(i);
+        sample_iter[t][d]++;
+        for (size_t k = 0; k < npops; ++k) {
+            double update = 0;
 
-                step_size = pow(sample_iter[t][d] + 1, step_power);
-                
-                if (snp_data.hemizygous(t, d)) {
-                    update += 0.5*snp_data.genotype(t, d, l)*phi[t][d][k] 
-                                    + 0.5*(2 - snp_data.genotype(t, d, l))*zeta[t][d][k];
-                }
-                else {
-                    update += snp_data.genotype(t, d, l)*phi[t][d][k] 
-                                    + (2 - snp_data.genotype(t, d, l))*zeta[t][d][k];
-                }
-                
-                theta[t][d][k] += step_size * (mixture_prior[k] + 
-                                               nloci_indv[t][d] * update -
-                                               theta[t][d][k]
-                                              );
-                theta[t][d][k] = max(theta[t][d][k], 1.0);
+            step_size = pow(sample_iter[t][d] + 1, step_power);
+            
+            if (snp_data.hemizygous(t, d)) {
+                update += 0.5*x*phi[t][d][k] 
+                                + 0.5*(2 - x)*zeta[t][d][k];
+            }
+            else {
+                update += x*phi[t][d][k] 
+                                + (2 - x)*zeta[t][d][k];
             }
+            
+            theta[t][d][k] += step_size * (mixture_prior[k] + 
+                                           nloci_indv[t][d] * snp_data.weight(locus) * update -
+                                           theta[t][d][k]
+                                          );
+            theta[t][d][k] = max(theta[t][d][k], 1.0);
         }
     }
 }
@@ -454,13 +490,13 @@ void SVI::update_mixture_proportions(int locus)
 void SVI::find_best_initialization()
 {
     cout << "trying 5 initializations..." << endl;
-    vector3<double> best_theta(theta);
-    vector3<double> best_pseudo_outputs(pseudo_outputs);
-    vector4<double> best_freqs(freqs);
-    vector2<double> best_initial_freq(initial_freq);
-    vector2<int>    best_sample_iter(sample_iter);
+    ParameterStore      best_store(store.directory());
+    vector3<double>     best_theta(theta);
+    vector3_ref<double> best_pseudo_outputs = best_store.copy(pseudo_outputs);
+    vector4_ref<double> best_freqs = best_store.copy(freqs);
+    vector2_ref<double> best_initial_freq = best_store.copy(initial_freq);
+    vector2<int>        best_sample_iter(sample_iter);
 
-    uniform_int_distribution<int> idist(0, nloci - 1);
     int ntries = 5;
     double best_obj = 0;
     bool converged = false;
@@ -468,7 +504,7 @@ void SVI::find_best_initialization()
     int locus;
     for (int n = 0; n < ntries; ++n) {
         for (size_t it = 0; it < nloci; ++it) {
-            locus = idist(gen);
+            locus = next_locus();
             converged = false;
             while (!converged) {
                 converged = update_auxiliary_parameters(locus);
@@ -498,6 +534,46 @@ void SVI::find_best_initialization()
 }
 
 
+int SVI::next_locus()
+{
+    if (!store.out_of_core()) {
+        uniform_int_distribution<int> idist(0, nloci - 1);
+        return idist(gen);
+    }
+
+    // Out of core, random loci would touch a different page of each
+    // parameter array at every step. Instead, blocks of consecutive loci
+    // are visited in random order, and the loci in each block in random
+    // order, so each pass visits every locus once.
+    if (block_loci.empty()) {
+        if (block_order.empty()) {
+            for (size_t b = 0; b + 1 < block_start.size(); ++b)
+                block_order.push_back(b);
+            shuffle(block_order);
+        }
+        size_t b = block_order.back();
+        block_order.pop_back();
+        for (size_t l = block_start[b]; l < block_start[b + 1]; ++l)
+            block_loci.push_back(l);
+        shuffle(block_loci);
+    }
+    int locus = block_loci.back();
+    block_loci.pop_back();
+    return locus;
+}
+
+
+
+void SVI::shuffle(vector<size_t>& v)
+{
+    for (size_t i = v.size(); i > 1; --i) {
+        uniform_int_distribution<size_t> idist(0, i - 1);
+        std::swap(v[i - 1], v[idist(gen)]);
+    }
+}
+
+
+
 void SVI::run_stochastic()
 {
     int          locus = 0;
@@ -508,8 +584,6 @@ void SVI::run_stochastic()
     double prv_obj     = 1;
     double obj         = 0;
 
-    uniform_int_distribution<int> idist(0, nloci - 1);
-
     if (multi_init) {
         find_best_initialization();
     } 
@@ -519,7 +593,7 @@ void SVI::run_stochastic()
     //while ( (obj > prv_obj && abs(obj - prv_obj > 1)) || epoch < 25) {
         it++;
         epoch = (int)(it/nloci);
-        locus = idist(gen);
+        locus = next_locus();
         //ss = pow(it + 1, step_power);
 
         converged = false;
@@ -559,7 +633,14 @@ void SVI::run_stochastic()
     cout << "objective:\t" << compute_objective() << endl;
 
     if (snp_data.has_hold_out()) {
-        cout << "hold out log likelihood:\t" << compute_ho_log_likelihood() << endl;
+        vector<double> chromosome_log_lk;
+        cout << "hold out log likelihood:\t" << compute_ho_log_likelihood(snp_data.has_positions() ? &chromosome_log_lk : NULL) << endl;
+        if (snp_data.has_positions()) {
+            const LocusPositions& positions = snp_data.locus_positions();
+            for (size_t c = 0; c < chromosome_log_lk.size(); ++c) {
+                cout << "\tchromosome " << positions.chromosome_names[c] << ":\t" << chromosome_log_lk[c] << endl;
+            }
+        }
     }
 }
 
@@ -571,7 +652,13 @@ void SVI::write_results(string out_file)
     ofstream out_freq(out_file + "_freqs");
     for (size_t t = 0; t < nsteps; ++t) {
         out_freq << t << endl;
-        for (size_t l = 0; l < nloci; ++l) {
+        for (size_t j = 0; j < snp_data.total_loaded_loci(); ++j) {
+            if (snp_data.has_positions()) {
+                const LocusPositions& positions = snp_data.locus_positions();
+                out_freq << positions.ids[j] << "\t" << positions.chromosome_names[positions.chromosome[j]] << "\t"
+                         << positions.position[j] << "\t";
+            }
+            size_t l = snp_data.merged_locus(j);
             for (size_t k = 0; k < npops - 1; ++k) {
                 out_freq << freqs[t][k][l][0] << "\t";
             }
@@ -582,8 +669,8 @@ void SVI::write_results(string out_file)
 
     ofstream out_theta(out_file + "_theta");
     for (int i = 0; i < nindv; ++i) {
-        int t = sample_map[i].first;
-        int d = sample_map[i].second;
+        int t = samples.time(i);
+        int d = samples.individual(i);
         double s = 0;
         for (size_t k = 0; k < npops; ++k) {
             s += theta[t][d][k];
@@ -602,8 +689,8 @@ void SVI::write_temp(string suffix = "")
 {
     ofstream out_theta("temp_theta" + suffix);
     for (int i = 0; i < nindv; ++i) {
-        int t = sample_map[i].first;
-        int d = sample_map[i].second;
+        int t = samples.time(i);
+        int d = samples.individual(i);
         for (size_t k = 0; k < npops - 1; ++k) {
             out_theta << theta[t][d][k] << "\t";
         }
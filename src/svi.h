@@ -22,12 +22,14 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <boost/random/mersenne_twister.hpp>
 #include <iostream>
-#include <map>
 #include <string>
 #include <vector>
 #include <utility>
 
+#include "parameter_store.h"
+#include "sample_table.h"
 #include "snp_data.h"
+#include "variational_kalman_smoother.h"
 #include "vector_types.h"
 
 // Stochastic variational inference
@@ -37,14 +39,16 @@ class SVI
     SVI(int                                 npops,
         std::vector<double>                 mixture_prior,
         double                              pop_size,        // fixed population size
-        SNPData                             snp_data,
+        const SNPData&                      snp_data,
         boost::random::mt19937&             gen,
         size_t                              nloci,
         int                                 nepochs,
-        std::map<int,std::pair<int, int> >  sample_map,
+        const SampleTable&                  samples,         // the time step and individual of each output row
         vector2<int>                        labels,
         bool                                multi_init,
-        bool                                using_labels = false);
+        bool                                using_labels = false,
+        std::string                         scratch_dir = "",     // if set, keeps the per-locus parameters in scratch files there
+        SmootherPlan::Solver                smoother_solver = SmootherPlan::CONJUGATE_GRADIENT);
 
     // Stochastic variational inference
     inline bool update_auxiliary_parameters(int locus);
@@ -53,8 +57,9 @@ class SVI
     void run_stochastic();
     void initialize_variational_parameters();
 
-    // Computes the log likelihood on a hold out set
-    double compute_ho_log_likelihood();
+    // Computes the log likelihood on a hold out set. If chromosome_log_lk is
+    // given, it is set to the log likelihood of each chromosome.
+    double compute_ho_log_likelihood(std::vector<double>* chromosome_log_lk = NULL);
     double compute_objective();
 
     void   write_results(std::string out_file);
@@ -66,14 +71,17 @@ class SVI
     const size_t                        nloci;
     const size_t                        nsteps;         // number of time steps with samples
     int                                 nindv;          // number of individuals
-    SNPData                             snp_data;       // snp data matrix
+    const SNPData&                      snp_data;       // snp data matrix
     boost::random::mt19937              gen;
     double                              pop_size;       // if specified, fixes population size rather than performing variational EM
-    vector2<double>                     initial_freq;   // parameters specifying initial allele frequencies: initial_freq[k][l] is the
+    SmootherPlan                        smoother_plan;  // variances and gains of the smoother, which depend only on the time steps and pop_size
+    std::vector<VariationalKalmanSmoother> smoothers;   // smoothers[k] is reused at every locus in population k
+    ParameterStore                      store;          // storage for the per-locus parameters below, which are stored locus by locus
+    vector2_ref<double>                 initial_freq;   // parameters specifying initial allele frequencies: initial_freq[k][l] is the
                                                         // initial frequency in population k at locus l
-    vector4<double>                     freqs;          // freqs[t][k][l] gives mean and variance parameters for current variational estimates of
+    vector4_ref<double>                 freqs;          // freqs[t][k][l] gives mean and variance parameters for current variational estimates of
                                                         // the allele frequencies in population k at locus l
-    vector3<double>                     pseudo_outputs; // the current pseudo outputs from the variational Kalman smoother
+    vector3_ref<double>                 pseudo_outputs; // the current pseudo outputs from the variational Kalman smoother
                                                         // these are indexed differently than other parameters! pseudo_outputs[k][l][t]
     vector3<double>                     theta;          // dirichlet variational parameters; theta[t][d][k] = kth parameter for the variational 
                                                         // dirichlet distribution corresponding to individual d sampled at time t
@@ -84,12 +92,20 @@ class SVI
     vector2<int>                        sample_iter;    // store the number of iterations for each sample. use for step size
     int                                 nepochs;        // number of epochs to run before terminating
     double                              step_power = -0.55;
-    std::map<int,std::pair<int, int> >  sample_map;     // map from original row in SNP matrix to row in ancestry proportions
+    const SampleTable&                  samples;        // time step and individual of each row in ancestry proportions
     bool                                using_labels = false;
     bool                                multi_init;
+    std::vector<size_t>                 block_start;    // block b of consecutive loci visited together when out of core is
+                                                        // block_start[b] to block_start[b+1] - 1
+    std::vector<size_t>                 block_order;    // blocks left to visit in the current pass over the loci
+    std::vector<size_t>                 block_loci;     // loci left to visit in the current block
+    LocusGenotypes                      observed;       // observed genotypes at the last locus visited
     
     inline void   update_auxiliary_local(size_t t, size_t d, size_t l);
     inline void   load_auxiliary_parameters(int l);
+    const LocusGenotypes& observed_at(size_t locus);
+    int           next_locus();
+    void          shuffle(std::vector<size_t>& v);
     void   write_temp(std::string suffix);
     std::pair<bool, double>   check_theta_convergence(const vector3<double>& prev_theta);
     void  find_best_initialization();
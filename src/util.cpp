@@ -18,9 +18,12 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
+#include <cctype>
+#include <cstdio>
 #include <cstdint>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <getopt.h>
 #include <iostream>
 #include <iterator>
@@ -28,6 +31,7 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #include <set>
 #include <iomanip>
 #include <map>
+#include <memory>
 #include <fstream>
 #include <string>
 #include <utility>
@@ -37,34 +41,128 @@ using std::cerr;
 using std::cout;
 using std::count;
 using std::exit;
+using std::fill;
 using std::endl;
 using std::find;
 using std::ifstream;
 using std::is_sorted;
+using std::isspace;
+using std::istream;
 using std::istringstream;
 using std::insert_iterator;
+using std::lower_bound;
 using std::map;
+using std::max;
+using std::max_element;
+using std::min;
+using std::min_element;
+using std::move;
+using std::ofstream;
 using std::pair;
+using std::replace;
 using std::set;
 using std::setprecision;
 using std::setw;
+using std::shared_ptr;
 using std::skipws;
 using std::sort;
 using std::string;
+using std::unique;
 using std::unique_copy;
 using std::vector;
 
+#include "genotype_matrix.h"
+#include "gzip_reader.h"
+#include "mapped_file.h"
+#include "sample_table.h"
 #include "snp_data.h"
 #include "util.h"
 #include "vector_types.h"
 
 
-vector<int> read_generations(string fname, vector<int>& gen_sampled)
+// Replaces each generation time by a time shared by its bin, where bins of
+// width generations start at the earliest time, following
+// supp/scripts/bin_sample_times.py: samples at exactly the earliest or the
+// latest time keep it, so the span of the samples is unchanged, and every
+// other sample takes the mean time of all samples in its bin, rounded down.
+void bin_generations(vector<int>& generations, int width)
 {
-    ifstream input(fname);
-    if (!input.is_open()) {
-        cerr << "cannot open " << fname << endl;
-        exit(1);
+    int first = *min_element(generations.begin(), generations.end());
+    int last = *max_element(generations.begin(), generations.end());
+    map<int, pair<long, int> > bins;                      // total time after first and count of each bin
+    for (size_t i = 0; i < generations.size(); ++i) {
+        pair<long, int>& bin = bins[(generations[i] - first) / width];
+        bin.first += generations[i] - first;
+        bin.second++;
+    }
+    for (size_t i = 0; i < generations.size(); ++i) {
+        if (generations[i] == first || generations[i] == last)
+            continue;
+        const pair<long, int>& bin = bins[(generations[i] - first) / width];
+        generations[i] = first + (int)(bin.first / bin.second);
+    }
+}
+
+
+
+// Bins the generation times with the bin width of binning, or the smallest
+// wider bin width that leaves at most binning.max_steps time steps.
+void bin_generations(vector<int>& generations, const TimeBinning& binning)
+{
+    vector<int> times(generations);
+    sort(times.begin(), times.end());
+    times.erase(unique(times.begin(), times.end()), times.end());
+
+    // the first and last bins can hold both a pinned time and the mean of
+    // the bin, so the time steps are counted after binning. Bins wider than
+    // the span of the times all hold every sample, so widening stops there.
+    int span = times.back() - times.front();
+    int width = max(binning.width, 1);
+    while (binning.max_steps > 0) {
+        vector<int> binned(generations);
+        bin_generations(binned, width);
+        int nsteps = set<int>(binned.begin(), binned.end()).size();
+        if (nsteps <= binning.max_steps)
+            break;
+        if (width > span) {
+            cerr << "--max-time-steps " << binning.max_steps << " cannot be reached: binning keeps the earliest and "
+                 << "latest generation times, which leaves at least " << nsteps << " time steps" << endl;
+            exit(1);
+        }
+        width++;
+    }
+
+    bin_generations(generations, width);
+    cout << "\tbinned " << times.size() << " generation times into " << set<int>(generations.begin(), generations.end()).size()
+         << " time steps of " << width << " generations..." << endl;
+}
+
+
+
+vector<int> read_generations(string fname, vector<int>& gen_sampled, const TimeBinning& binning)
+{
+    ifstream file;
+    istringstream text;
+    istream* input = &file;
+    if (is_gzip(fname)) {
+        GzipLineReader reader(fname);
+        vector<pair<const char*, const char*> > lines;
+        string contents;
+        while (reader.next_lines(lines)) {
+            for (size_t i = 0; i < lines.size(); ++i) {
+                contents.append(lines[i].first, lines[i].second);
+                contents.push_back('\n');
+            }
+        }
+        text.str(contents);
+        input = &text;
+    }
+    else {
+        file.open(fname);
+        if (!file.is_open()) {
+            cerr << "cannot open " << fname << endl;
+            exit(1);
+        }
     }
 
     string line;
@@ -72,7 +170,7 @@ vector<int> read_generations(string fname, vector<int>& gen_sampled)
     int c;
     int g;
     istringstream iss(line);
-    while (getline(input, line)) {
+    while (getline(*input, line)) {
         iss = istringstream(line);
         c = 0;
         while (iss >> skipws >> g) {
@@ -84,6 +182,8 @@ vector<int> read_generations(string fname, vector<int>& gen_sampled)
             }
         }
     }
+    if (binning.active() && !generations.empty())
+        bin_generations(generations, binning);
 
     // remove duplicate sample times so we can aggregate samples by generation sampled
     vector<int> generations_sorted(generations);
@@ -91,138 +191,1465 @@ vector<int> read_generations(string fname, vector<int>& gen_sampled)
     insert_iterator<vector<int> > insert_it(gen_sampled, gen_sampled.begin());
     unique_copy(generations_sorted.begin(), generations_sorted.end(), insert_it);
 
-    input.close();
-
     return generations;
 }
 
 
-int check_input_file(string fname, int nloci, int n_columns)
-{   
+// Reads a list of loci: 1-based locus numbers or inclusive ranges such as
+// 1001-2000, separated by whitespace or commas. Returns the sorted 0-based
+// indices of the listed loci.
+vector<size_t> read_locus_selection(string fname)
+{
     ifstream input(fname);
     if (!input.is_open()) {
         cerr << "cannot open " << fname << endl;
         exit(1);
     }
 
+    vector<size_t> loci;
+    string token;
+    while (input >> token) {
+        replace(token.begin(), token.end(), ',', ' ');
+        istringstream entries(token);
+        string entry;
+        while (entries >> entry) {
+            unsigned long first = 0;
+            unsigned long last = 0;
+            char dash;
+            istringstream range(entry);
+            bool ok = (range >> first) && first > 0;
+            if (ok && range >> dash)
+                ok = dash == '-' && (range >> last) && last >= first && range.eof();
+            else
+                last = first;
+            if (!ok) {
+                cerr << "Input Error (" << fname << "): invalid locus or range '" << entry << "'" << endl;
+                exit(1);
+            }
+            for (unsigned long l = first; l <= last; ++l)
+                loci.push_back(l - 1);
+        }
+    }
+    sort(loci.begin(), loci.end());
+    loci.erase(unique(loci.begin(), loci.end()), loci.end());
+    if (loci.empty()) {
+        cerr << "Input Error (" << fname << "): no loci selected" << endl;
+        exit(1);
+    }
+    return loci;
+}
+
+
+
+// Reads the sample IDs in the given column (0-based) of a whitespace
+// separated file with one sample per line, such as an EIGENSTRAT .ind file
+// (column 0) or a PLINK .fam file (column 1).
+vector<string> read_sample_ids(string fname, int column)
+{
+    ifstream input(fname);
+    if (!input.is_open()) {
+        cerr << "cannot open " << fname << endl;
+        exit(1);
+    }
+
+    vector<string> ids;
     string line;
-    istringstream iss(line);
-    int locus_count = 0;
-    int col_count = 0;
-    int g = 0;
-    char c[] = "X";
     while (getline(input, line)) {
-        locus_count++;
-        iss = istringstream(line);
-        col_count = 0;
+        istringstream fields(line);
+        string field;
+        string id;
+        for (int c = 0; c <= column && fields >> field; ++c) {
+            if (c == column)
+                id = field;
+        }
+        if (id == "") continue;
+        ids.push_back(id);
+    }
+    return ids;
+}
 
-        int nonmissing = 0;
-        while (iss >> c[0]) {
-            g = atoi(c);
-            col_count++;
 
-            if (!(g == 0 || g == 1 || g == 2 || g == 9)) {
-                cerr << "Input Error (" << fname << "): line " << locus_count << " column "
-                     << col_count + 1 << " has an invalid entry." << endl;
-                cerr << "Genotypes must be 0, 1, or 2 if known, 9 if missing or unknown." << endl;
+
+// Reads the sample IDs from the #CHROM header line of a VCF file.
+vector<string> read_vcf_sample_ids(string fname)
+{
+    string header;
+    if (is_gzip(fname)) {
+        GzipLineReader reader(fname);
+        vector<pair<const char*, const char*> > lines;
+        while (header == "" && reader.next_lines(lines)) {
+            for (size_t i = 0; i < lines.size() && header == ""; ++i) {
+                if (lines[i].second - lines[i].first >= 6 && memcmp(lines[i].first, "#CHROM", 6) == 0)
+                    header.assign(lines[i].first, lines[i].second);
+            }
+        }
+    }
+    else {
+        ifstream input(fname);
+        if (!input.is_open()) {
+            cerr << "cannot open " << fname << endl;
+            exit(1);
+        }
+        string line;
+        while (header == "" && getline(input, line) && line.compare(0, 1, "#") == 0) {
+            if (line.compare(0, 6, "#CHROM") == 0)
+                header = line;
+        }
+    }
+    if (header == "") {
+        cerr << "Input Error (" << fname << "): missing #CHROM header line" << endl;
+        exit(1);
+    }
+
+    vector<string> ids;
+    istringstream fields(header);
+    string id;
+    for (int c = 0; fields >> id; ++c) {
+        if (c >= 9)
+            ids.push_back(id);
+    }
+    return ids;
+}
+
+
+
+// Reads a list of samples with one sample per line, given by the first field
+// of the line. Samples are identified by their ID if ids, the IDs of the input
+// samples, is not empty, and by their 1-based position in the input
+// otherwise. Returns the sorted 0-based indices of the listed samples.
+vector<size_t> read_sample_selection(string fname, const vector<string>& ids)
+{
+    vector<string> entries = read_sample_ids(fname, 0);
+    map<string, size_t> index;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        index.insert(pair<string, size_t>(ids[i], i));
+    }
+
+    vector<size_t> samples;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!ids.empty()) {
+            map<string, size_t>::const_iterator it = index.find(entries[i]);
+            if (it == index.end()) {
+                cerr << "Input Error (" << fname << "): unknown sample '" << entries[i] << "'" << endl;
                 exit(1);
             }
+            samples.push_back(it->second);
+        }
+        else {
+            char* end;
+            unsigned long s = strtoul(entries[i].c_str(), &end, 10);
+            if (*end != '\0' || s == 0) {
+                cerr << "Input Error (" << fname << "): invalid sample number '" << entries[i] << "'" << endl;
+                cerr << "Use --ind to select samples by ID." << endl;
+                exit(1);
+            }
+            samples.push_back(s - 1);
+        }
+    }
+    sort(samples.begin(), samples.end());
+    samples.erase(unique(samples.begin(), samples.end()), samples.end());
+    if (samples.empty()) {
+        cerr << "Input Error (" << fname << "): no samples selected" << endl;
+        exit(1);
+    }
+    return samples;
+}
+
+
+
+// Returns the offset of the first character of each line in the file. The
+// file is split into chunks that are searched for newlines in parallel.
+vector<size_t> index_lines(const MappedFile& input)
+{
+    const char* data = input.data();
+    size_t size = input.size();
+    vector<size_t> line_start;
+    if (size == 0)
+        return line_start;
+    line_start.push_back(0);
 
-            if (g == 0 || g == 1 || g == 2) {
-                nonmissing += 1;
+    const int nchunks = 64;
+    vector<vector<size_t> > chunk_starts(nchunks);
+    #pragma omp parallel for schedule(dynamic)
+    for (int chunk = 0; chunk < nchunks; ++chunk) {
+        const char* p = data + size / nchunks * chunk;
+        const char* end = (chunk == nchunks - 1) ? data + size : data + size / nchunks * (chunk + 1);
+        while (p < end && (p = (const char*)memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            if (p == data + size) break;
+            chunk_starts[chunk].push_back(p - data);
+        }
+    }
+
+    for (int chunk = 0; chunk < nchunks; ++chunk)
+        line_start.insert(line_start.end(), chunk_starts[chunk].begin(), chunk_starts[chunk].end());
+    return line_start;
+}
+
+
+
+// Decodes one line of the genotype matrix into ncols genotype codes. Returns
+// the number of genotypes on the line, and sets bad_col to the first column
+// holding an invalid entry, or -1 if every entry is valid.
+int decode_genotype_line(const char* begin, const char* end, int ncols, unsigned char* row, int& bad_col)
+{
+    bad_col = -1;
+    if (end > begin && end[-1] == '\r')
+        end--;
+
+    if (end - begin == ncols) {
+        // common case: one character per genotype, no whitespace. this loop is
+        // branch free so the compiler vectorizes it.
+        unsigned char bad = 0;
+        for (int i = 0; i < ncols; ++i) {
+            unsigned char g = begin[i] - '0';
+            bad |= (g > 2) & (g != 9);
+            row[i] = (g > 2) ? GenotypeMatrix::MISSING : g;
+        }
+        if (bad) {
+            for (int i = 0; i < ncols && bad_col == -1; ++i) {
+                unsigned char g = begin[i] - '0';
+                if (!(g <= 2 || g == 9))
+                    bad_col = i;
             }
         }
+        return ncols;
+    }
 
-        if (col_count != n_columns) {
-            cerr << "Input Error (" << fname << "): line " << locus_count << " has "
-                 << col_count << " samples, but generation file has " << n_columns << "." << endl;
-            exit(1);
+    // entries separated by whitespace
+    int col = 0;
+    for (const char* p = begin; p < end; ++p) {
+        if (isspace(*p)) continue;
+        unsigned char g = *p - '0';
+        if (!(g <= 2 || g == 9) && bad_col == -1)
+            bad_col = col;
+        if (col < ncols)
+            row[col] = (g > 2) ? GenotypeMatrix::MISSING : g;
+        col++;
+    }
+    return col;
+}
+
+
+
+// Decodes loci of an ASCII EIGENSTRAT genotype matrix, one locus per line.
+class AsciiGenoDecoder
+{
+    public:
+        AsciiGenoDecoder(const MappedFile& input, const vector<size_t>& line_start, int ncols)
+            : input(input), line_start(line_start), ncols(ncols) { }
+
+        // decodes locus l into row, and returns the number of genotypes on the line
+        int decode(size_t l, unsigned char* row, int& bad_col) const
+        {
+            const char* begin = input.data() + line_start[l];
+            const char* end = (l + 1 < line_start.size()) ? input.data() + line_start[l + 1] - 1
+                                                           : input.data() + input.size();
+            if (l + 1 == line_start.size() && end > begin && end[-1] == '\n')
+                end--;
+            return decode_genotype_line(begin, end, ncols, row, bad_col);
         }
 
-        if (nonmissing == 0) {
-            cerr << "Input Warning (" << fname << "): line " << locus_count 
-                 << " has no nonmissing entries" << endl;
+        bool operator() (size_t l, unsigned char* row) const
+        {
+            int bad_col;
+            return decode(l, row, bad_col) == ncols && bad_col == -1;
         }
 
-        if (nonmissing == 1) {
-            cerr << "Input Warning (" << fname << "): line " << locus_count 
-                 << " only has 1 nonmissing entry" << endl;
+    private:
+        const MappedFile&       input;
+        const vector<size_t>&   line_start;
+        int                     ncols;
+};
+
+
+
+// Decodes loci stored as fixed length records of 2-bit packed genotypes. Each
+// byte is expanded to four genotype codes with a lookup table.
+class TwoBitDecoder
+{
+    public:
+        // code maps each 2-bit value to a genotype code, and msb_first gives the
+        // order of the genotypes within a byte
+        TwoBitDecoder(const unsigned char* first_record, size_t rlen, int ncols, const unsigned char code[4], bool msb_first)
+            : first_record(first_record), rlen(rlen), nbytes((ncols + 3) / 4)
+        {
+            for (int b = 0; b < 256; ++b) {
+                for (int j = 0; j < 4; ++j) {
+                    int shift = msb_first ? 6 - 2*j : 2*j;
+                    table[b][j] = code[(b >> shift) & 3];
+                }
+            }
+        }
+
+        bool operator() (size_t l, unsigned char* row) const
+        {
+            const unsigned char* record = first_record + l*rlen;
+            for (size_t b = 0; b < nbytes; ++b) {
+                for (int j = 0; j < 4; ++j) {
+                    row[4*b + j] = table[record[b]][j];
+                }
+            }
+            return true;
+        }
+
+    private:
+        const unsigned char*    first_record;
+        size_t                  rlen;
+        size_t                  nbytes;
+        unsigned char           table[256][4];
+};
+
+
+
+// Decodes the GT field of VCF records, one locus per line. Genotypes count
+// copies of the alternate alleles, so multiallelic sites are collapsed to
+// reference and non-reference. Haploid calls are coded 0 or 2, like pseudo
+// haploid EIGENSTRAT genotypes, so samples whose calls are all haploid are
+// treated as hemizygous.
+class VcfDecoder
+{
+    public:
+        VcfDecoder(const MappedFile& input, const vector<size_t>& line_start, size_t first_record, int ncols)
+            : input(input), line_start(line_start), first_record(first_record), ncols(ncols) { }
+
+        // decodes locus l into row, and returns the number of samples in the
+        // record
+        int decode(size_t l, unsigned char* row, int& bad_col) const
+        {
+            size_t line = first_record + l;
+            const char* begin = input.data() + line_start[line];
+            const char* end = (line + 1 < line_start.size()) ? input.data() + line_start[line + 1] - 1
+                                                              : input.data() + input.size();
+            if (line + 1 == line_start.size() && end > begin && end[-1] == '\n')
+                end--;
+            return decode_record(begin, end, ncols, row, bad_col);
+        }
+
+        bool operator() (size_t l, unsigned char* row) const
+        {
+            int bad_col;
+            return decode(l, row, bad_col) == ncols && bad_col == -1;
+        }
+
+        // decodes the record on one line into ncols genotype codes. Returns the
+        // number of samples in the record, and sets bad_col to the first sample
+        // with an invalid genotype, or -1. Records without a GT field have
+        // every genotype missing.
+        static int decode_record(const char* p, const char* end, int ncols, unsigned char* row, int& bad_col)
+        {
+            if (end > p && end[-1] == '\r')
+                end--;
+
+            // skip CHROM, POS, ID, REF, ALT, QUAL, FILTER and INFO
+            bad_col = -1;
+            for (int field = 0; field < 8 && p != NULL; ++field) {
+                p = (const char*)memchr(p, '\t', end - p);
+                if (p != NULL)
+                    p++;
+            }
+            if (p == NULL)
+                return 0;
+
+            // GT is the first FORMAT key whenever it is present
+            bool has_gt = end - p >= 2 && p[0] == 'G' && p[1] == 'T' && (end - p == 2 || p[2] == ':' || p[2] == '\t');
+
+            int col = 0;
+            while ((p = (const char*)memchr(p, '\t', end - p)) != NULL) {
+                p++;
+                unsigned char g = GenotypeMatrix::MISSING;
+                if (has_gt && !decode_gt(p, end, g) && bad_col == -1)
+                    bad_col = col;
+                if (col < ncols)
+                    row[col] = g;
+                col++;
+            }
+            return col;
+        }
+
+    private:
+        // decodes the GT value starting at p into a genotype code. Returns
+        // false if it is not a haploid or diploid call.
+        static bool decode_gt(const char* p, const char* end, unsigned char& g)
+        {
+            int nalleles = 0;
+            int nalt = 0;
+            bool missing = false;
+            while (true) {
+                if (p < end && *p == '.') {
+                    missing = true;
+                    p++;
+                }
+                else if (p < end && *p >= '0' && *p <= '9') {
+                    bool alt = false;
+                    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+                        alt |= (*p != '0');
+                    nalt += alt;
+                }
+                else {
+                    return false;
+                }
+                nalleles++;
+
+                if (p < end && (*p == '/' || *p == '|'))
+                    p++;
+                else
+                    break;
+            }
+            if ((p < end && *p != ':' && *p != '\t') || nalleles > 2)
+                return false;
+
+            if (missing)
+                g = GenotypeMatrix::MISSING;
+            else
+                g = (nalleles == 1) ? 2*nalt : nalt;
+            return true;
+        }
+
+        const MappedFile&       input;
+        const vector<size_t>&   line_start;
+        size_t                  first_record;   // line of the first record, after the header
+        int                     ncols;
+};
+
+
+
+const size_t NO_ROW = (size_t)-1;
+
+
+
+// Decodes every locus with decode and packs the genotypes into the genotype
+// matrix, where column_row[i] is the row of the matrix holding input column i,
+// or NO_ROW if column i is not loaded. Threads work on blocks of loci that fill whole words, so no two threads
+// write to the same word. Returns the first locus the decoder rejected, or -1.
+template <typename Decoder>
+int pack_loci(const Decoder& decode, GenotypeMatrix& snps, const vector<size_t>& column_row, vector<int>& nonmissing)
+{
+    const size_t per_word = GenotypeMatrix::CODES_PER_WORD;
+    int ncols = column_row.size();
+    size_t nloci = snps.total_loci();
+    size_t nblocks = (nloci + per_word - 1) / per_word;
+    bool locus_major = (snps.layout() == GenotypeMatrix::LOCUS_MAJOR);
+    size_t err_locus = nloci;
+
+    #pragma omp parallel
+    {
+        vector<unsigned char> row(4*((ncols + 3) / 4));
+        vector<unsigned char> stripe_codes(locus_major ? snps.stripe_words()*per_word : 0);
+        vector<uint64_t> acc(ncols);
+        #pragma omp for schedule(static)
+        for (size_t block = 0; block < nblocks; ++block) {
+            size_t first = block*per_word;
+            size_t last = min(first + per_word, nloci);
+            fill(acc.begin(), acc.end(), 0);
+            for (size_t l = first; l < last; ++l) {
+                if (!decode(l, &row[0])) {
+                    #pragma omp critical
+                    err_locus = min(err_locus, l);
+                    continue;
+                }
+
+                int observed = 0;
+                for (int i = 0; i < ncols; ++i) {
+                    observed += (row[i] != GenotypeMatrix::MISSING && column_row[i] != NO_ROW);
+                }
+                nonmissing[l] = observed;
+
+                if (locus_major) {
+                    // reorder the columns by row, then pack the whole locus
+                    fill(stripe_codes.begin(), stripe_codes.end(), GenotypeMatrix::MISSING);
+                    for (int i = 0; i < ncols; ++i) {
+                        if (column_row[i] != NO_ROW)
+                            stripe_codes[column_row[i]] = row[i];
+                    }
+                    uint64_t* stripe = snps.stripe(l);
+                    for (size_t w = 0; w < snps.stripe_words(); ++w) {
+                        uint64_t word = 0;
+                        for (size_t j = 0; j < per_word; ++j) {
+                            word |= (uint64_t)stripe_codes[w*per_word + j] << (2*j);
+                        }
+                        stripe[w] = word;
+                    }
+                }
+                else {
+                    int shift = 2*(l - first);
+                    for (int i = 0; i < ncols; ++i) {
+                        acc[i] |= (uint64_t)row[i] << shift;
+                    }
+                }
+            }
+
+            if (!locus_major) {
+                // entries past the last locus are missing
+                uint64_t pad = (last - first == per_word) ? 0 : ~(uint64_t)0 << (2*(last - first));
+                for (int i = 0; i < ncols; ++i) {
+                    if (column_row[i] != NO_ROW)
+                        snps.stripe(column_row[i])[block] = acc[i] | pad;
+                }
+            }
         }
     }
+    return err_locus == nloci ? -1 : (int)err_locus;
+}
 
-    if (nloci != locus_count) {
-        cerr << "Input Warning (" << fname << "): " << nloci << " were specified, but "
-             << locus_count << " were found." << endl;
+
+
+// Decodes the input loci listed in loci, in order.
+template <typename Decoder>
+class SelectedLoci
+{
+    public:
+        SelectedLoci(const Decoder& decode, const vector<size_t>& loci) : decode(decode), loci(loci) { }
+
+        bool operator() (size_t l, unsigned char* row) const
+        {
+            return decode(loci[l], row);
+        }
+
+    private:
+        const Decoder&          decode;
+        const vector<size_t>&   loci;
+};
+
+
+
+// Packs the loci of the input listed in loci, or every locus if loci is empty.
+// Returns the first input locus the decoder rejected, or -1.
+template <typename Decoder>
+int pack_selected_loci(const Decoder& decode, const vector<size_t>& loci, GenotypeMatrix& snps,
+                       const vector<size_t>& column_row, vector<int>& nonmissing)
+{
+    if (loci.empty())
+        return pack_loci(decode, snps, column_row, nonmissing);
+    int err_locus = pack_loci(SelectedLoci<Decoder>(decode, loci), snps, column_row, nonmissing);
+    return err_locus == -1 ? -1 : (int)loci[err_locus];
+}
+
+
+
+// Decodes a gzip compressed text file with one locus per line into records of
+// 2-bit genotype codes, (ncols + 3) / 4 bytes per locus with the first column
+// in the low bits of the first byte. The lines of each decompressed buffer are
+// decoded in parallel while the following buffers are decompressed.
+//
+// decode_line(begin, end, row, bad_col) decodes one line as
+// decode_genotype_line does. Lines starting with '#' before the first locus
+// are passed to header if header_lines is set. report(line, count, bad_col)
+// is called for the first line that cannot be decoded, and must not return.
+// Only the loci listed in loci are kept, unless it is empty. Returns the
+// number of loci in the file.
+template <typename LineDecoder, typename HeaderHandler, typename ErrorHandler>
+size_t read_gzip_loci(string fname, int ncols, LineDecoder decode_line, bool header_lines, HeaderHandler header,
+                      ErrorHandler report, const vector<size_t>& loci, vector<unsigned char>& records)
+{
+    size_t rlen = (ncols + 3) / 4;
+    size_t nloci = 0;
+    size_t nkept = 0;
+    size_t nheader = 0;
+    vector<size_t> kept;
+    GzipLineReader reader(fname);
+    vector<pair<const char*, const char*> > lines;
+    while (reader.next_lines(lines)) {
+        size_t first = 0;
+        if (header_lines && nloci == 0) {
+            for (; first < lines.size() && lines[first].first < lines[first].second && *lines[first].first == '#'; ++first) {
+                header(lines[first].first, lines[first].second);
+                nheader++;
+            }
+        }
+
+        // the lines of this buffer that are kept, skipping the rest undecoded
+        size_t nlines = lines.size() - first;
+        kept.clear();
+        for (size_t i = 0; i < nlines; ++i) {
+            if (loci.empty() || (nkept + kept.size() < loci.size() && loci[nkept + kept.size()] == nloci + i))
+                kept.push_back(i);
+        }
+        records.resize((nkept + kept.size())*rlen);
+
+        size_t err_line = nlines;
+        #pragma omp parallel
+        {
+            vector<unsigned char> row(4*rlen, GenotypeMatrix::MISSING);
+            #pragma omp for schedule(static)
+            for (size_t j = 0; j < kept.size(); ++j) {
+                size_t i = kept[j];
+                int bad_col;
+                if (decode_line(lines[first + i].first, lines[first + i].second, &row[0], bad_col) != ncols || bad_col != -1) {
+                    #pragma omp critical
+                    err_line = min(err_line, i);
+                    continue;
+                }
+                unsigned char* record = &records[(nkept + j)*rlen];
+                for (size_t b = 0; b < rlen; ++b) {
+                    record[b] = row[4*b] | (row[4*b + 1] << 2) | (row[4*b + 2] << 4) | (row[4*b + 3] << 6);
+                }
+            }
+        }
+
+        if (err_line != nlines) {
+            vector<unsigned char> row(4*rlen);
+            int bad_col;
+            int count = decode_line(lines[first + err_line].first, lines[first + err_line].second, &row[0], bad_col);
+            report(nheader + nloci + err_line + 1, count, bad_col);
+        }
+        nloci += nlines;
+        nkept += kept.size();
     }
+    return nloci;
+}
+
 
-    return locus_count;
+
+// Packed EIGENSTRAT (PACKEDANCESTRYMAP) files start with a header record
+// "GENO nind nsnp ihash shash", followed by one record per locus. Records are
+// max(48, ceil(nind / 4)) bytes long, and hold 2 bits per genotype with the
+// first individual in the high bits of the first byte. The code 3 is missing.
+bool is_packed_geno(const MappedFile& input)
+{
+    return input.size() >= 5 && (memcmp(input.data(), "GENO ", 5) == 0 || memcmp(input.data(), "TGENO", 5) == 0);
 }
 
 
-map<int, pair<int, int> > read_snp_matrix(string fname, string gen_fname, std_vector3<short> *snps, vector<int>& gen_sampled, int& nloci)
+
+size_t packed_geno_record_length(int nind)
 {
-    cout << "loading genotype matrix (this should not take more than a few minutes)..." << endl;
-    cout << "\tchecking input file..." << endl;
-    vector<int> generations = read_generations(gen_fname, gen_sampled);
-    int found_loci = check_input_file(fname, nloci, generations.size());
+    return max(48, (nind + 3) / 4);
+}
+
+
+
+// Checks the header of a packed genotype file and returns the number of loci.
+int read_packed_geno_header(const MappedFile& input, string fname, int ncols)
+{
+    if (memcmp(input.data(), "TGENO", 5) == 0) {
+        cerr << "Input Error (" << fname << "): transposed packed genotype files are not supported." << endl;
+        cerr << "Use convertf to convert to PACKEDANCESTRYMAP or EIGENSTRAT format." << endl;
+        exit(1);
+    }
+
+    string header(input.data(), min(input.size(), (size_t)48));
+    int nind = 0;
+    int nsnp = 0;
+    if (sscanf(header.c_str(), "GENO %d %d", &nind, &nsnp) != 2) {
+        cerr << "Input Error (" << fname << "): malformed packed genotype header" << endl;
+        exit(1);
+    }
+
+    if (nind != ncols) {
+        cerr << "Input Error (" << fname << "): file has " << nind
+             << " samples, but generation file has " << ncols << "." << endl;
+        exit(1);
+    }
+
+    size_t rlen = packed_geno_record_length(nind);
+    if (input.size() < (nsnp + 1) * rlen) {
+        cerr << "Input Error (" << fname << "): header specifies " << nsnp << " loci, but file is truncated." << endl;
+        exit(1);
+    }
+    return nsnp;
+}
+
+
+
+// Groups the selected samples in the input by time step and allocates the
+// genotype matrix. Only the time steps of selected samples are kept in
+// gen_sampled. On return column_row[i] is the row of snps holding the
+// genotypes of sample i, or NO_ROW if sample i is not selected. Returns a map
+// from the index of each selected sample, in input order, to (time step, row)
+// in the genotype matrix.
+SampleTable group_samples(const vector<int>& generations, vector<int>& gen_sampled,
+                          const vector<size_t>& selected_samples, int nloci, GenotypeMatrix::Layout layout,
+                          GenotypeMatrix *snps, vector<size_t>& column_row)
+{
+    int ncols = generations.size();
+    vector<bool> selected(ncols, selected_samples.empty());
+    for (size_t i = 0; i < selected_samples.size(); ++i) {
+        selected[selected_samples[i]] = true;
+    }
+    if (!selected_samples.empty()) {
+        vector<int> selected_generations;
+        for (int i = 0; i < ncols; ++i) {
+            if (selected[i])
+                selected_generations.push_back(generations[i]);
+        }
+        sort(selected_generations.begin(), selected_generations.end());
+        gen_sampled.assign(selected_generations.begin(), unique(selected_generations.begin(), selected_generations.end()));
+    }
+
+    vector<int> sample_column;
+    vector<int> sample_time;
+    vector<int> nsamples(gen_sampled.size(), 0);
+    for (int i = 0; i < ncols; ++i) {
+        if (!selected[i]) continue;
+        int t = lower_bound(gen_sampled.begin(), gen_sampled.end(), generations[i]) - gen_sampled.begin();
+        sample_column.push_back(i);
+        sample_time.push_back(t);
+        nsamples[t]++;
+    }
+
+    // individuals at each time step are numbered in input order
+    SampleTable samples;
+    *snps = GenotypeMatrix(nsamples, nloci, layout);
+    column_row.assign(ncols, NO_ROW);
+    vector<int> next_indiv(nsamples.size(), 0);
+    for (size_t i = 0; i < sample_column.size(); ++i) {
+        int t = sample_time[i];
+        samples.add(t, next_indiv[t]++);
+        column_row[sample_column[i]] = snps->row_index(t, samples.individual(i));
+    }
+
+    cout << "\tfound " << samples.size() << " samples at " << gen_sampled.size() << " time points..." << endl;
+    cout << "\tusing " << nloci << " loci..." << endl;
+    return samples;
+}
+
+
+
+void check_loci_count(string fname, int found_loci, int& nloci)
+{
+    if (found_loci == 0) {
+        cerr << "Input Error (" << fname << "): no loci found" << endl;
+        exit(1);
+    }
+    if (nloci != found_loci) {
+        cerr << "Input Warning (" << fname << "): " << nloci << " were specified, but "
+             << found_loci << " were found." << endl;
+    }
     nloci = found_loci;
+}
 
-    cout << "\tfound " << generations.size() << " samples at " << gen_sampled.size() << " time points..." << endl;
-    cout << "\tusing " << nloci << " loci..." << endl; 
 
-    ifstream input(fname);
-    if (!input.is_open()) {
+
+// Checks the selected loci and samples against the size of the input, and
+// sets nloci to the number of loci to load.
+void check_selection(string fname, int found_loci, int ncols, const InputSelection& selection, int& nloci)
+{
+    // --nloci may give either the size of the file or of the selection
+    if (selection.loci.empty() || nloci != (int)selection.loci.size())
+        check_loci_count(fname, found_loci, nloci);
+    if (!selection.loci.empty() && selection.loci.back() >= (size_t)found_loci) {
+        cerr << "Input Error (" << fname << "): locus " << selection.loci.back() + 1 << " was selected, but the file has "
+             << found_loci << " loci." << endl;
+        exit(1);
+    }
+    if (!selection.samples.empty() && selection.samples.back() >= (size_t)ncols) {
+        cerr << "Input Error (" << fname << "): sample " << selection.samples.back() + 1 << " was selected, but the file has "
+             << ncols << " samples." << endl;
+        exit(1);
+    }
+    if (!selection.loci.empty())
+        nloci = selection.loci.size();
+}
+
+
+
+// Warns about loci with fewer than two genotypes. loci gives the input locus
+// of each locus in nonmissing, unless it is empty.
+void warn_sparse_loci(string fname, string unit, const vector<int>& nonmissing, const vector<size_t>& loci)
+{
+    for (size_t l = 0; l < nonmissing.size(); ++l) {
+        size_t input_locus = loci.empty() ? l : loci[l];
+        if (nonmissing[l] == 0) {
+            cerr << "Input Warning (" << fname << "): " << unit << " " << input_locus + 1
+                 << " has no nonmissing entries" << endl;
+        }
+        if (nonmissing[l] == 1) {
+            cerr << "Input Warning (" << fname << "): " << unit << " " << input_locus + 1
+                 << " only has 1 nonmissing entry" << endl;
+        }
+    }
+}
+
+
+
+void report_geno_line_error(string fname, size_t line, int count, int bad_col, int ncols)
+{
+    if (bad_col != -1) {
+        cerr << "Input Error (" << fname << "): line " << line << " column "
+             << bad_col + 1 << " has an invalid entry." << endl;
+        cerr << "Genotypes must be 0, 1, or 2 if known, 9 if missing or unknown." << endl;
+    }
+    else {
+        cerr << "Input Error (" << fname << "): line " << line << " has "
+             << count << " samples, but generation file has " << ncols << "." << endl;
+    }
+    exit(1);
+}
+
+
+
+// Decodes the loci of a gzip compressed EIGENSTRAT genotype matrix. Loci are
+// staged as 2-bit records until their number is known, and then packed into
+// the genotype matrix.
+SampleTable read_gzip_snp_matrix(string fname, const vector<int>& generations, vector<int>& gen_sampled,
+                                 GenotypeMatrix *snps, int& nloci, GenotypeMatrix::Layout layout,
+                                 const InputSelection& selection)
+{
+    int ncols = generations.size();
+    vector<unsigned char> records;
+    size_t found_loci = read_gzip_loci(fname, ncols,
+        [ncols](const char* begin, const char* end, unsigned char* row, int& bad_col) {
+            return decode_genotype_line(begin, end, ncols, row, bad_col);
+        },
+        false, [](const char*, const char*) { },
+        [&](size_t line, int count, int bad_col) { report_geno_line_error(fname, line, count, bad_col, ncols); },
+        selection.loci, records);
+    check_selection(fname, found_loci, ncols, selection, nloci);
+
+    vector<size_t> column_row;
+    SampleTable samples = group_samples(generations, gen_sampled, selection.samples, nloci, layout, snps, column_row);
+
+    const unsigned char code[4] = { 0, 1, 2, GenotypeMatrix::MISSING };
+    TwoBitDecoder decoder(&records[0], (ncols + 3) / 4, ncols, code, false);
+    vector<int> nonmissing(nloci, 0);
+    pack_loci(decoder, *snps, column_row, nonmissing);
+    warn_sparse_loci(fname, "line", nonmissing, selection.loci);
+
+    return samples;
+}
+
+
+
+SampleTable read_snp_matrix(string fname, string gen_fname, GenotypeMatrix *snps, vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning)
+{
+    cout << "loading genotype matrix..." << endl;
+    vector<int> generations = read_generations(gen_fname, gen_sampled, binning);
+    int ncols = generations.size();
+    if (is_gzip(fname))
+        return read_gzip_snp_matrix(fname, generations, gen_sampled, snps, nloci, layout, selection);
+
+    MappedFile input(fname);
+    bool packed = is_packed_geno(input);
+    vector<size_t> line_start;
+    if (packed) {
+        check_selection(fname, read_packed_geno_header(input, fname, ncols), ncols, selection, nloci);
+    }
+    else {
+        line_start = index_lines(input);
+        check_selection(fname, line_start.size(), ncols, selection, nloci);
+    }
+
+    vector<size_t> column_row;
+    SampleTable samples = group_samples(generations, gen_sampled, selection.samples, nloci, layout, snps, column_row);
+
+    vector<int> nonmissing(nloci, 0);
+    if (packed) {
+        // packed EIGENSTRAT codes are the genotype codes used by GenotypeMatrix
+        const unsigned char code[4] = { 0, 1, 2, GenotypeMatrix::MISSING };
+        size_t rlen = packed_geno_record_length(ncols);
+        TwoBitDecoder decoder((const unsigned char*)input.data() + rlen, rlen, ncols, code, true);
+        pack_selected_loci(decoder, selection.loci, *snps, column_row, nonmissing);
+    }
+    else {
+        AsciiGenoDecoder decoder(input, line_start, ncols);
+        int err_line = pack_selected_loci(decoder, selection.loci, *snps, column_row, nonmissing);
+        if (err_line != -1) {
+            vector<unsigned char> row(ncols);
+            int bad_col;
+            int line_cols = decoder.decode(err_line, &row[0], bad_col);
+            report_geno_line_error(fname, err_line + 1, line_cols, bad_col, ncols);
+        }
+    }
+    warn_sparse_loci(fname, packed ? "locus" : "line", nonmissing, selection.loci);
+
+    return samples;
+}
+
+
+
+// The .bim and .fam files share the prefix of the .bed file.
+string plink_prefix(string bed_fname)
+{
+    if (bed_fname.size() > 4 && bed_fname.compare(bed_fname.size() - 4, 4, ".bed") == 0)
+        return bed_fname.substr(0, bed_fname.size() - 4);
+    return bed_fname;
+}
+
+
+
+// Counts the lines in a PLINK .bim or .fam file.
+int count_lines(string fname)
+{
+    MappedFile input(fname);
+    return index_lines(input).size();
+}
+
+
+
+SampleTable read_bed_matrix(string fname, string gen_fname, GenotypeMatrix *snps, vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning)
+{
+    cout << "loading genotype matrix..." << endl;
+    vector<int> generations = read_generations(gen_fname, gen_sampled, binning);
+    int ncols = generations.size();
+
+    string prefix = plink_prefix(fname);
+    int nind = count_lines(prefix + ".fam");
+    if (nind != ncols) {
+        cerr << "Input Error (" << prefix << ".fam): file has " << nind
+             << " samples, but generation file has " << ncols << "." << endl;
+        exit(1);
+    }
+    size_t found_loci = count_lines(prefix + ".bim");
+    check_selection(prefix + ".bim", found_loci, ncols, selection, nloci);
+
+    // SNP-major .bed files start with the magic number 0x6c 0x1b followed by 0x01.
+    // Each locus is a record of ceil(nind / 4) bytes holding 2 bits per genotype,
+    // with the first individual in the low bits of the first byte.
+    MappedFile input(fname);
+    const unsigned char* data = (const unsigned char*)input.data();
+    if (input.size() < 3 || data[0] != 0x6c || data[1] != 0x1b) {
+        cerr << "Input Error (" << fname << "): not a PLINK .bed file" << endl;
+        exit(1);
+    }
+    if (data[2] != 0x01) {
+        cerr << "Input Error (" << fname << "): individual-major .bed files are not supported." << endl;
+        cerr << "Use plink --make-bed to write a SNP-major file." << endl;
+        exit(1);
+    }
+    size_t rlen = (ncols + 3) / 4;
+    if (input.size() != 3 + found_loci*rlen) {
+        cerr << "Input Error (" << fname << "): expected " << 3 + found_loci*rlen << " bytes for "
+             << found_loci << " loci and " << ncols << " samples, but found " << input.size() << "." << endl;
+        exit(1);
+    }
+
+    vector<size_t> column_row;
+    SampleTable samples = group_samples(generations, gen_sampled, selection.samples, nloci, layout, snps, column_row);
+
+    // genotypes count copies of the A1 allele: 00 is homozygous A1, 01 is
+    // missing, 10 is heterozygous, and 11 is homozygous A2
+    const unsigned char code[4] = { 2, GenotypeMatrix::MISSING, 1, 0 };
+    TwoBitDecoder decoder(data + 3, rlen, ncols, code, false);
+    vector<int> nonmissing(nloci, 0);
+    pack_selected_loci(decoder, selection.loci, *snps, column_row, nonmissing);
+    warn_sparse_loci(fname, "locus", nonmissing, selection.loci);
+
+    return samples;
+}
+
+
+void check_vcf_samples(string fname, const char* header, const char* header_end, int ncols)
+{
+    int nsamples = (int)count(header, header_end, '\t') - 8;
+    if (nsamples != ncols) {
+        cerr << "Input Error (" << fname << "): file has " << max(nsamples, 0)
+             << " samples, but generation file has " << ncols << "." << endl;
+        exit(1);
+    }
+}
+
+
+
+void report_vcf_record_error(string fname, size_t line, int count, int bad_col, int ncols)
+{
+    if (bad_col != -1) {
+        cerr << "Input Error (" << fname << "): line " << line << " sample "
+             << bad_col + 1 << " has an invalid GT entry." << endl;
+        cerr << "Genotypes must be haploid or diploid calls such as 0, 1, 0/1, 1|1 or ./." << endl;
+    }
+    else {
+        cerr << "Input Error (" << fname << "): line " << line << " has "
+             << count << " samples, but generation file has " << ncols << "." << endl;
+    }
+    exit(1);
+}
+
+
+
+// Decodes the records of a gzip or bgzip compressed VCF file. As for
+// compressed EIGENSTRAT files, loci are staged as 2-bit records first.
+SampleTable read_gzip_vcf_matrix(string fname, const vector<int>& generations, vector<int>& gen_sampled,
+                                 GenotypeMatrix *snps, int& nloci, GenotypeMatrix::Layout layout,
+                                 const InputSelection& selection)
+{
+    int ncols = generations.size();
+    bool found_header = false;
+    vector<unsigned char> records;
+    size_t found_loci = read_gzip_loci(fname, ncols,
+        [ncols](const char* begin, const char* end, unsigned char* row, int& bad_col) {
+            return VcfDecoder::decode_record(begin, end, ncols, row, bad_col);
+        },
+        true, [&](const char* begin, const char* end) {
+            found_header = end - begin >= 6 && memcmp(begin, "#CHROM", 6) == 0;
+            if (found_header)
+                check_vcf_samples(fname, begin, end, ncols);
+        },
+        [&](size_t line, int count, int bad_col) {
+            if (!found_header) {
+                cerr << "Input Error (" << fname << "): missing #CHROM header line" << endl;
+                exit(1);
+            }
+            report_vcf_record_error(fname, line, count, bad_col, ncols);
+        },
+        selection.loci, records);
+    if (!found_header) {
+        cerr << "Input Error (" << fname << "): missing #CHROM header line" << endl;
+        exit(1);
+    }
+    check_selection(fname, found_loci, ncols, selection, nloci);
+
+    vector<size_t> column_row;
+    SampleTable samples = group_samples(generations, gen_sampled, selection.samples, nloci, layout, snps, column_row);
+
+    const unsigned char code[4] = { 0, 1, 2, GenotypeMatrix::MISSING };
+    TwoBitDecoder decoder(&records[0], (ncols + 3) / 4, ncols, code, false);
+    vector<int> nonmissing(nloci, 0);
+    pack_loci(decoder, *snps, column_row, nonmissing);
+    warn_sparse_loci(fname, "record", nonmissing, selection.loci);
+
+    return samples;
+}
+
+
+
+SampleTable read_vcf_matrix(string fname, string gen_fname, GenotypeMatrix *snps, vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning)
+{
+    cout << "loading genotype matrix..." << endl;
+    vector<int> generations = read_generations(gen_fname, gen_sampled, binning);
+    int ncols = generations.size();
+    if (is_gzip(fname))
+        return read_gzip_vcf_matrix(fname, generations, gen_sampled, snps, nloci, layout, selection);
+
+    // header lines start with '#', and the last one names the samples
+    MappedFile input(fname);
+    vector<size_t> line_start = index_lines(input);
+    size_t first_record = 0;
+    while (first_record < line_start.size() && input.data()[line_start[first_record]] == '#')
+        first_record++;
+    const char* header = (first_record > 0) ? input.data() + line_start[first_record - 1] : NULL;
+    if (header == NULL || input.data() + input.size() - header < 6 || memcmp(header, "#CHROM", 6) != 0) {
+        cerr << "Input Error (" << fname << "): missing #CHROM header line" << endl;
+        exit(1);
+    }
+    const char* header_end = (first_record < line_start.size()) ? input.data() + line_start[first_record]
+                                                                 : input.data() + input.size();
+    check_vcf_samples(fname, header, header_end, ncols);
+    check_selection(fname, line_start.size() - first_record, ncols, selection, nloci);
+
+    vector<size_t> column_row;
+    SampleTable samples = group_samples(generations, gen_sampled, selection.samples, nloci, layout, snps, column_row);
+
+    VcfDecoder decoder(input, line_start, first_record, ncols);
+    vector<int> nonmissing(nloci, 0);
+    int err_locus = pack_selected_loci(decoder, selection.loci, *snps, column_row, nonmissing);
+    if (err_locus != -1) {
+        vector<unsigned char> row(ncols);
+        int bad_col;
+        int record_cols = decoder.decode(err_locus, &row[0], bad_col);
+        report_vcf_record_error(fname, first_record + err_locus + 1, record_cols, bad_col, ncols);
+    }
+    warn_sparse_loci(fname, "record", nonmissing, selection.loci);
+
+    return samples;
+}
+
+
+
+// Reads the ID, chromosome and physical position of each locus from an
+// EIGENSTRAT .snp file (ID, chromosome, genetic position, physical position)
+// or, if the file name ends in .bim, a PLINK .bim file (chromosome, ID,
+// genetic position, physical position). Only the selected loci are kept,
+// unless loci is empty, in which case the file must list nloci loci.
+LocusPositions read_locus_positions(string fname, const vector<size_t>& loci, int nloci)
+{
+    bool bim = fname.size() > 4 && fname.compare(fname.size() - 4, 4, ".bim") == 0;
+    const int id_col = bim ? 1 : 0;
+    const int chrom_col = bim ? 0 : 1;
+    const int pos_col = 3;
+
+    cout << "loading locus positions..." << endl;
+    MappedFile input(fname);
+    vector<size_t> line_start = index_lines(input);
+    map<string, int> chrom_index;
+    LocusPositions positions;
+    size_t found_loci = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < line_start.size(); ++i) {
+        const char* p = input.data() + line_start[i];
+        const char* end = (i + 1 < line_start.size()) ? input.data() + line_start[i + 1] : input.data() + input.size();
+
+        // split the line into its first four fields
+        pair<const char*, const char*> field[4];
+        int nfields = 0;
+        while (nfields < 4) {
+            while (p < end && isspace(*p)) p++;
+            if (p == end) break;
+            field[nfields].first = p;
+            while (p < end && !isspace(*p)) p++;
+            field[nfields++].second = p;
+        }
+        if (nfields == 0) continue;
+        if (nfields < 4) {
+            cerr << "Input Error (" << fname << "): expected 4 fields on line " << i + 1 << ", but found "
+                 << nfields << "." << endl;
+            exit(1);
+        }
+
+        size_t locus = found_loci++;
+        if (!loci.empty() && (next == loci.size() || loci[next] != locus)) continue;
+        next++;
+
+        string pos(field[pos_col].first, field[pos_col].second);
+        char* pos_end;
+        long bp = strtol(pos.c_str(), &pos_end, 10);
+        if (*pos_end != '\0') {
+            cerr << "Input Error (" << fname << "): invalid position '" << pos << "' on line " << i + 1 << endl;
+            exit(1);
+        }
+        string chrom(field[chrom_col].first, field[chrom_col].second);
+        map<string, int>::const_iterator it = chrom_index.find(chrom);
+        if (it == chrom_index.end()) {
+            it = chrom_index.insert(pair<string, int>(chrom, positions.chromosome_names.size())).first;
+            positions.chromosome_names.push_back(chrom);
+        }
+        positions.ids.push_back(string(field[id_col].first, field[id_col].second));
+        positions.chromosome.push_back(it->second);
+        positions.position.push_back(bp);
+    }
+
+    if (loci.empty() && found_loci != (size_t)nloci) {
+        cerr << "Input Error (" << fname << "): file has " << found_loci << " loci, but the genotype matrix has "
+             << nloci << "." << endl;
+        exit(1);
+    }
+    if (!loci.empty() && next != loci.size()) {
+        cerr << "Input Error (" << fname << "): locus " << loci.back() + 1 << " was selected, but the file has "
+             << found_loci << " loci." << endl;
+        exit(1);
+    }
+    cout << "\tfound " << positions.chromosome_names.size() << " chromosomes..." << endl;
+    return positions;
+}
+
+
+
+// Drops the loci that fail the filter from snps, so that no per-locus
+// parameters are allocated for them. Returns the indices of the kept loci
+// in snps, and sets nloci to their number.
+vector<size_t> filter_loci(GenotypeMatrix *snps, const LocusFilter& filter, bool pseudo_haploid, int& nloci)
+{
+    cout << "filtering loci..." << endl;
+    size_t nrows = snps->total_rows();
+    vector<bool> heterozygous = snps->heterozygous_rows();
+    vector<char> haploid(nrows);
+    for (size_t i = 0; i < nrows; ++i)
+        haploid[i] = pseudo_haploid && !heterozygous[i];
+
+    // 0 if locus l is kept, and otherwise 1 if it has too many missing
+    // genotypes or 2 if its minor allele is too rare
+    vector<char> dropped(nloci, 0);
+    #pragma omp parallel
+    {
+        vector<unsigned char> codes(nrows);
+        #pragma omp for schedule(static)
+        for (int l = 0; l < nloci; ++l) {
+            snps->locus_codes(l, &codes[0]);
+            size_t observed = 0;
+            size_t alleles = 0;
+            size_t alt = 0;
+            for (size_t i = 0; i < nrows; ++i) {
+                if (codes[i] == GenotypeMatrix::MISSING) continue;
+                observed++;
+                alleles += haploid[i] ? 1 : 2;
+                alt += haploid[i] ? codes[i] / 2 : codes[i];
+            }
+            size_t minor = min(alt, alleles - alt);
+            double maf = (alleles == 0) ? 0 : (double)minor / alleles;
+            if (nrows - observed > filter.max_missing*nrows)
+                dropped[l] = 1;
+            else if (maf < filter.min_maf || (int)minor < filter.min_minor_alleles || alleles == 0)
+                dropped[l] = 2;
+        }
+    }
+
+    vector<size_t> kept;
+    for (int l = 0; l < nloci; ++l) {
+        if (!dropped[l])
+            kept.push_back(l);
+    }
+    if (kept.empty()) {
+        cerr << "Input Error: no loci pass the locus filters" << endl;
+        exit(1);
+    }
+    cout << "\tdropped " << count(dropped.begin(), dropped.end(), 1) << " loci with too many missing genotypes and "
+         << count(dropped.begin(), dropped.end(), 2) << " loci with a rare or absent minor allele..." << endl;
+    cout << "\tusing " << kept.size() << " loci..." << endl;
+
+    if (kept.size() < (size_t)nloci)
+        *snps = snps->select_loci(kept);
+    nloci = kept.size();
+    return kept;
+}
+
+
+
+// Merges loci with the same genotype in every row into the first of them,
+// so that each distinct locus is only processed once during inference.
+// Returns the distinct locus holding each locus of snps, and sets nloci to
+// the number of distinct loci.
+vector<size_t> merge_duplicate_loci(GenotypeMatrix *snps, int& nloci)
+{
+    cout << "merging duplicate loci..." << endl;
+    size_t nrows = snps->total_rows();
+
+    // loci are grouped by a hash of their genotypes, and only loci in the
+    // same group are compared
+    vector<pair<uint64_t, size_t> > hashed(nloci);
+    #pragma omp parallel
+    {
+        vector<unsigned char> codes(nrows);
+        #pragma omp for schedule(static)
+        for (int l = 0; l < nloci; ++l) {
+            snps->locus_codes(l, &codes[0]);
+            uint64_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < nrows; ++i)
+                h = (h ^ codes[i])*1099511628211ULL;
+            hashed[l] = pair<uint64_t, size_t>(h, l);
+        }
+    }
+    sort(hashed.begin(), hashed.end());
+
+    // merged[l] is first set to the first locus identical to l
+    vector<size_t> merged(nloci);
+    vector<unsigned char> codes(nrows);
+    for (size_t a = 0, b; a < hashed.size(); a = b) {
+        for (b = a + 1; b < hashed.size() && hashed[b].first == hashed[a].first; ++b) ;
+        merged[hashed[a].second] = hashed[a].second;
+        if (b == a + 1) continue;
+
+        vector<size_t> distinct;
+        vector<vector<unsigned char> > distinct_codes;
+        for (size_t i = a; i < b; ++i) {
+            size_t l = hashed[i].second;
+            snps->locus_codes(l, &codes[0]);
+            size_t d = 0;
+            while (d < distinct.size() && distinct_codes[d] != codes) d++;
+            if (d == distinct.size()) {
+                distinct.push_back(l);
+                distinct_codes.push_back(codes);
+            }
+            merged[l] = distinct[d];
+        }
+    }
+
+    // number the distinct loci in input order
+    vector<size_t> distinct;
+    vector<size_t> index(nloci);
+    for (int l = 0; l < nloci; ++l) {
+        if (merged[l] == (size_t)l) {
+            index[l] = distinct.size();
+            distinct.push_back(l);
+        }
+        merged[l] = index[merged[l]];
+    }
+    cout << "\tmerged " << nloci - distinct.size() << " duplicate loci..." << endl;
+    cout << "\tusing " << distinct.size() << " distinct loci..." << endl;
+
+    if (distinct.size() < (size_t)nloci)
+        *snps = snps->select_loci(distinct);
+    nloci = distinct.size();
+    return merged;
+}
+
+
+
+LocusPositions select_positions(const LocusPositions& positions, const vector<size_t>& loci)
+{
+    LocusPositions selected;
+    selected.chromosome_names = positions.chromosome_names;
+    for (size_t i = 0; i < loci.size(); ++i) {
+        selected.ids.push_back(positions.ids[loci[i]]);
+        selected.chromosome.push_back(positions.chromosome[loci[i]]);
+        selected.position.push_back(positions.position[loci[i]]);
+    }
+    return selected;
+}
+
+
+
+// Writes 1-based locus numbers, one per line, in the format read by --loci.
+void write_locus_map(string fname, const vector<size_t>& loci)
+{
+    ofstream out(fname);
+    for (size_t i = 0; i < loci.size(); ++i) {
+        out << loci[i] + 1 << "\n";
+    }
+}
+
+
+
+// Binary dataset cache written by --write-cache. Fields are stored in native
+// byte order, followed by
+//     int32_t  gen_sampled[ntimes]
+//     int32_t  nindividuals[ntimes]
+//     int32_t  sample_time[nsamples], sample_row[nsamples]  (the sample map)
+//     uint8_t  heterozygous[nrows]
+// and, at the next multiple of 8 bytes, the nwords genotype words of the
+// GenotypeMatrix, which are mapped directly when the cache is read.
+struct CacheHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint64_t nloci;
+    uint64_t ntimes;
+    uint64_t nsamples;
+    uint64_t nwords;
+};
+
+const char     CACHE_MAGIC[8] = { 'D', 'Y', 'S', 'T', 'R', 'U', 'C', 'T' };
+const uint32_t CACHE_VERSION = 1;
+
+
+
+size_t cache_words_offset(const CacheHeader& header, size_t nrows)
+{
+    size_t offset = sizeof(CacheHeader) + 4*(2*header.ntimes + 2*header.nsamples) + nrows;
+    return (offset + 7) / 8 * 8;
+}
+
+
+
+void write_cache(string fname, const GenotypeMatrix& snps, const vector<int>& gen_sampled, const SampleTable& samples)
+{
+    cout << "writing dataset cache to " << fname << "..." << endl;
+    ofstream out(fname, std::ios::binary);
+    if (!out.is_open()) {
         cerr << "cannot open " << fname << endl;
         exit(1);
     }
 
-    string line;
-    int ct;
-    for (size_t t = 0; t < gen_sampled.size(); ++t) {
-        ct = count(generations.begin(), generations.end(), gen_sampled[t]);
-        (*snps).push_back(vector2<short>(boost::extents[ct][nloci]));
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.layout = snps.layout();
+    header.nloci = snps.total_loci();
+    header.ntimes = snps.total_time_steps();
+    header.nsamples = samples.size();
+    header.nwords = snps.total_words();
+    out.write((const char*)&header, sizeof(header));
+
+    vector<int32_t> fields;
+    for (size_t t = 0; t < header.ntimes; ++t)
+        fields.push_back(gen_sampled[t]);
+    for (size_t t = 0; t < header.ntimes; ++t)
+        fields.push_back(snps.total_individuals(t));
+    for (size_t i = 0; i < header.nsamples; ++i)
+        fields.push_back(samples.time(i));
+    for (size_t i = 0; i < header.nsamples; ++i)
+        fields.push_back(samples.individual(i));
+    out.write((const char*)&fields[0], 4*fields.size());
+
+    vector<bool> heterozygous = snps.heterozygous_rows();
+    vector<uint8_t> het(heterozygous.begin(), heterozygous.end());
+    out.write((const char*)&het[0], het.size());
+
+    size_t offset = sizeof(header) + 4*fields.size() + het.size();
+    string padding(cache_words_offset(header, het.size()) - offset, '\0');
+    out.write(padding.data(), padding.size());
+    out.write((const char*)snps.data(), 8*header.nwords);
+
+    if (!out.good()) {
+        cerr << "error writing " << fname << endl;
+        exit(1);
     }
+    out.close();
+}
 
-    short genotype = 0;
-    int i;
-    int l = 0;
-    int gen;
-    int index;
-    istringstream iss(line);
-    char c[] = "X";
-    while (getline(input, line)) {
-        iss = istringstream(line);
-        i = 0;
-        map<int, int> gen_to_nsamples; // generation to number of samples
-        while (iss >> c[0]) {
-            genotype = atoi(c);
-            gen = generations[i];
-            index = find(gen_sampled.begin(), gen_sampled.end(), gen) - gen_sampled.begin();
-            (*snps)[index][gen_to_nsamples[gen]][l] = genotype;
-            gen_to_nsamples[gen]++;
-            i++;
-        }
-        l++;
-        if (l == nloci)
-            break;
+
+
+SampleTable read_cache(string fname, GenotypeMatrix *snps, vector<int>& gen_sampled, int& nloci)
+{
+    cout << "loading dataset cache..." << endl;
+    shared_ptr<const MappedFile> input(new MappedFile(fname));
+
+    CacheHeader header;
+    if (input->size() < sizeof(header)) {
+        cerr << "Input Error (" << fname << "): not a dystruct cache" << endl;
+        exit(1);
+    }
+    memcpy(&header, input->data(), sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, 8) != 0) {
+        cerr << "Input Error (" << fname << "): not a dystruct cache" << endl;
+        exit(1);
+    }
+    if (header.version != CACHE_VERSION) {
+        cerr << "Input Error (" << fname << "): cache version " << header.version << " is not supported,"
+             << " rerun with --write-cache to rebuild it" << endl;
+        exit(1);
     }
-    input.close();
 
-    // need a map from original sample index to row index in genotype matrix
-    map<int, pair<int, int> > sample_map;
-    map<int, int> gen_to_nsamples;
-    for (size_t i = 0; i < generations.size(); ++i) {
-        gen = generations[i];
-        index = find(gen_sampled.begin(), gen_sampled.end(), gen) - gen_sampled.begin();
-        sample_map[(int)i] = pair<int, int>(index, gen_to_nsamples[gen]);
-        gen_to_nsamples[gen]++;
+    // bounding the counts by the file size first keeps the sizes below from overflowing
+    size_t fields_size = 4*(2*header.ntimes + 2*header.nsamples);
+    if (header.ntimes > input->size() || header.nsamples > input->size() || input->size() < sizeof(header) + fields_size) {
+        cerr << "Input Error (" << fname << "): cache is truncated" << endl;
+        exit(1);
+    }
+    const int32_t* fields = (const int32_t*)(input->data() + sizeof(header));
+    gen_sampled.assign(fields, fields + header.ntimes);
+    vector<int> nindividuals(fields + header.ntimes, fields + 2*header.ntimes);
+    const int32_t* sample_time = fields + 2*header.ntimes;
+    const int32_t* sample_row = sample_time + header.nsamples;
+
+    if (header.layout != GenotypeMatrix::INDIVIDUAL_MAJOR && header.layout != GenotypeMatrix::LOCUS_MAJOR) {
+        cerr << "Input Error (" << fname << "): invalid genotype layout " << header.layout << endl;
+        exit(1);
+    }
+    size_t nrows = 0;
+    for (size_t t = 0; t < header.ntimes; ++t) {
+        if (nindividuals[t] < 0) {
+            cerr << "Input Error (" << fname << "): invalid number of individuals at time step " << t + 1 << endl;
+            exit(1);
+        }
+        nrows += nindividuals[t];
+    }
+    if (header.nsamples != nrows) {
+        cerr << "Input Error (" << fname << "): cache has " << header.nsamples << " samples for " << nrows << " rows" << endl;
+        exit(1);
     }
-    return sample_map;
+    size_t words_offset = cache_words_offset(header, nrows);
+    if (header.nwords > input->size() || input->size() != words_offset + 8*header.nwords) {
+        cerr << "Input Error (" << fname << "): cache is truncated" << endl;
+        exit(1);
+    }
+
+    // the words must be exactly the codes of a matrix with these dimensions,
+    // otherwise the matrix would read past them
+    const uint64_t* words = (const uint64_t*)(input->data() + words_offset);
+    GenotypeMatrix matrix(nindividuals, header.nloci, (GenotypeMatrix::Layout)header.layout, input, words);
+    if (matrix.total_words() != header.nwords) {
+        cerr << "Input Error (" << fname << "): cache holds " << header.nwords << " genotype words, but "
+             << matrix.total_words() << " are needed for " << header.nloci << " loci and " << nrows << " samples" << endl;
+        exit(1);
+    }
+
+    check_loci_count(fname, header.nloci, nloci);
+    cout << "\tfound " << header.nsamples << " samples at " << gen_sampled.size() << " time points..." << endl;
+    cout << "\tusing " << nloci << " loci..." << endl;
+
+    const uint8_t* het = (const uint8_t*)input->data() + sizeof(header) + fields_size;
+    *snps = move(matrix);
+    snps->set_heterozygous_rows(vector<bool>(het, het + nrows));
+
+    SampleTable samples;
+    for (size_t i = 0; i < header.nsamples; ++i) {
+        if (sample_time[i] < 0 || sample_time[i] >= (int)header.ntimes || sample_row[i] < 0 || sample_row[i] >= nindividuals[sample_time[i]]) {
+            cerr << "Input Error (" << fname << "): invalid sample " << i + 1 << endl;
+            exit(1);
+        }
+        samples.add(sample_time[i], sample_row[i]);
+    }
+    return samples;
 }
 
 
-// This is no longer correct
-vector2<int> read_pop_labels(string fname, SNPData& snp_data)
+
+// Reads one label per line for each sample, in input order.
+vector2<int> read_pop_labels(string fname, SNPData& snp_data, const SampleTable& samples)
 {
     vector2<int> labels(boost::extents[snp_data.total_time_steps()][snp_data.max_individuals()]);
 
@@ -235,13 +1662,11 @@ vector2<int> read_pop_labels(string fname, SNPData& snp_data)
     string line;
     istringstream iss;
     int label;
-    for (size_t t = 0; t < snp_data.total_time_steps(); ++t) {
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            getline(input, line);
-            iss = istringstream(line);
-            iss >> skipws >> label;
-            labels[t][d] = label;
-        }
+    for (size_t i = 0; i < samples.size(); ++i) {
+        getline(input, line);
+        iss = istringstream(line);
+        iss >> skipws >> label;
+        labels[samples.time(i)][samples.individual(i)] = label;
     }
     input.close();
     return labels;
@@ -21,14 +21,66 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #define UTIL_DYSTRUCT_H
 
 #include <string>
-#include <map>
 #include <utility>
 #include <vector>
 
+#include "genotype_matrix.h"
+#include "sample_table.h"
 #include "snp_data.h"
 #include "vector_types.h"
 
-std::map<int, std::pair<int, int> > read_snp_matrix(std::string fname, std::string gen_fname, std_vector3<short> *snps, std::vector<int>& gen_sampled, int& nloci);
-vector2<int> read_pop_labels(std::string fname, SNPData& snp_data);
+// The loci and samples of an input file to load, as sorted 0-based indices.
+// An empty list selects every locus or sample.
+struct InputSelection
+{
+    std::vector<size_t> loci;
+    std::vector<size_t> samples;
+};
+
+// Groups the generation times into bins to reduce the number of time steps.
+// Bins are width generations wide, and are widened until there are at most
+// max_steps time steps if max_steps is set.
+struct TimeBinning
+{
+    int width;
+    int max_steps;
+
+    TimeBinning() : width(0), max_steps(0) { }
+    bool active() const { return width > 0 || max_steps > 0; }
+};
+
+// Thresholds for dropping uninformative loci after loading. Allele counts
+// are taken over the observed genotypes, with hemizygous samples counted
+// once. A locus without observed genotypes has a minor allele frequency of 0.
+struct LocusFilter
+{
+    double min_maf;                 // minimum minor allele frequency
+    double max_missing;             // maximum fraction of missing genotypes
+    int    min_minor_alleles;       // minimum minor allele count: 1 drops monomorphic loci, 2 also drops singletons
+
+    LocusFilter() : min_maf(0), max_missing(1), min_minor_alleles(0) { }
+    bool active() const { return min_maf > 0 || max_missing < 1 || min_minor_alleles > 0; }
+};
+
+std::vector<size_t> read_locus_selection(std::string fname);
+std::vector<size_t> read_sample_selection(std::string fname, const std::vector<std::string>& ids);
+std::vector<std::string> read_sample_ids(std::string fname, int column);
+std::vector<std::string> read_vcf_sample_ids(std::string fname);
+std::string plink_prefix(std::string bed_fname);
+
+SampleTable read_snp_matrix(std::string fname, std::string gen_fname, GenotypeMatrix *snps, std::vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning);
+SampleTable read_bed_matrix(std::string fname, std::string gen_fname, GenotypeMatrix *snps, std::vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning);
+SampleTable read_vcf_matrix(std::string fname, std::string gen_fname, GenotypeMatrix *snps, std::vector<int>& gen_sampled, int& nloci,
+                            GenotypeMatrix::Layout layout, const InputSelection& selection, const TimeBinning& binning);
+LocusPositions read_locus_positions(std::string fname, const std::vector<size_t>& loci, int nloci);
+std::vector<size_t> filter_loci(GenotypeMatrix *snps, const LocusFilter& filter, bool pseudo_haploid, int& nloci);
+std::vector<size_t> merge_duplicate_loci(GenotypeMatrix *snps, int& nloci);
+LocusPositions select_positions(const LocusPositions& positions, const std::vector<size_t>& loci);
+void write_locus_map(std::string fname, const std::vector<size_t>& loci);
+SampleTable read_cache(std::string fname, GenotypeMatrix *snps, std::vector<int>& gen_sampled, int& nloci);
+void write_cache(std::string fname, const GenotypeMatrix& snps, const std::vector<int>& gen_sampled, const SampleTable& samples);
+vector2<int> read_pop_labels(std::string fname, SNPData& snp_data, const SampleTable& samples);
 
 #endif
\ No newline at end of file
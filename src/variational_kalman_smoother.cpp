@@ -22,10 +22,10 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
 #include <boost/numeric/ublas/io.hpp>
-#include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <utility>
 #include <vector>
 
@@ -37,75 +37,235 @@ using std::pair;
 using std::cout;
 using std::endl;
 using std::max;
-using boost::numeric::ublas::matrix;
+using std::min;
+using std::numeric_limits;
 using boost::numeric::ublas::vector;
 
 #include <iomanip>
 using std::setprecision;
 
-VariationalKalmanSmoother::VariationalKalmanSmoother(const SNPData& snp_data,
-                                                     const vector3<double>& outputs,
-                                                     double initial_mean,
-                                                     const vector3<double>& phi,
-                                                     const vector3<double>& zeta,
-                                                     double pop_size,
-                                                     size_t pop,
-                                                     size_t locus) :
-    parameters(snp_data.total_time_steps() + 1, 0),
-    var(snp_data.total_time_steps(), 0),
-    f_mean(snp_data.total_time_steps(), 0),
-    f_var(snp_data.total_time_steps(), 0),
-    marg_mean(snp_data.total_time_steps(), 0),
-    marg_var(snp_data.total_time_steps(), 0),
-    forward_partials(snp_data.total_time_steps(), snp_data.total_time_steps() + 1, 0), // time points by number of parameters
-    partials(snp_data.total_time_steps(), snp_data.total_time_steps() + 1, 0),
-    param_forward_derivative(snp_data.total_time_steps(), 0),
-    param_backward_derivative(snp_data.total_time_steps(), 0),
-    sum_phi(snp_data.total_time_steps(), 0),
-    sum_zeta(snp_data.total_time_steps(), 0),
-    phi_zeta(snp_data.total_time_steps(), 0),
-    dt(snp_data.total_time_steps(), 0),
-    diff_partials(snp_data.total_time_steps(), snp_data.total_time_steps()+ 1, 0),
-    diff_means(snp_data.total_time_steps(), 0),
-    time_points(snp_data.total_time_steps()),
-    pop(pop),
-    locus(locus)
+SmootherPlan::SmootherPlan(const SNPData& snp_data, double pop_size, Solver solver,
+                           size_t nscan_blocks, size_t min_scan_steps) :
+    ntimes(snp_data.total_time_steps()),
+    size(pop_size),
+    method(solver),
+    delta(ntimes, 0),
+    precision(ntimes, 0),
+    forward_var(ntimes, 0),
+    marginal_var(ntimes, 0),
+    f_gain(ntimes, 0),
+    b_gain(ntimes, 0)
+{
+    // variational parameter for the output variance of the pseudo-outputs
+    double out_var = 0.001;
+
+    // state space variance
+    vector<double> var(ntimes, 0);
+    delta[0] = 1;
+    var[0] = 1. / (12*pop_size);
+    for (size_t t = 1; t < ntimes; ++t) {
+        delta[t] = snp_data.get_sample_gen(t) - snp_data.get_sample_gen(t-1);
+        var[t] = delta[t] / (12.*pop_size);
+    }
+    for (size_t t = 0; t < ntimes; ++t)
+        precision[t] = 12*pop_size/delta[t];
+    double initial_variance = var[0];
+
+    // forward variances
+    f_gain[0] = out_var / (initial_variance + var[0] + out_var);
+    forward_var[0] = f_gain[0] * (initial_variance + var[0]);
+    for (size_t t = 1; t < ntimes; ++t) {
+        f_gain[t] = out_var / (forward_var[t-1] + var[t] + out_var);
+        forward_var[t] = f_gain[t] * (forward_var[t-1] + var[t]);
+    }
+
+    // marginal variances
+    marginal_var[ntimes - 1] = forward_var[ntimes - 1];
+    for (size_t t = ntimes - 2; t < ntimes; --t) {
+        b_gain[t] = var[t] / (forward_var[t] + var[t]);
+        marginal_var[t] = forward_var[t] + (forward_var[t] / (forward_var[t] + var[t]))*(forward_var[t] / (forward_var[t] + var[t]))
+                                         * (marginal_var[t+1] - forward_var[t] - var[t]);
+    }
+
+    // coefficients of the recurrences for the means and their adjoints,
+    // where the last marginal mean is the last forward mean
+    bool split = nscan_blocks > 1 && ntimes >= min_scan_steps;
+    block_len = split ? (ntimes + nscan_blocks - 1) / nscan_blocks : ntimes;
+    nblocks = (ntimes + block_len - 1) / block_len;
+    f_mean_scan.a = f_gain;
+    marg_mean_scan.a.resize(ntimes);
+    marg_adjoint_scan.a.resize(ntimes);
+    f_adjoint_scan.a.resize(ntimes);
+    for (size_t t = 0; t < ntimes; ++t) {
+        marg_mean_scan.a[t] = (t + 1 < ntimes) ? 1 - b_gain[t] : 0;
+        marg_adjoint_scan.a[t] = (t > 0) ? 1 - b_gain[t-1] : 0;
+        f_adjoint_scan.a[t] = (t + 1 < ntimes) ? f_gain[t+1] : 0;
+    }
+    set_carry(f_mean_scan, false);
+    set_carry(marg_mean_scan, true);
+    set_carry(marg_adjoint_scan, false);
+    set_carry(f_adjoint_scan, true);
+}
+
+
+
+void SmootherPlan::set_carry(LinearScan& scan, bool reverse)
+{
+    scan.carry.resize(ntimes);
+    for (size_t b = 0; b < nblocks; ++b) {
+        size_t start = b*block_len;
+        size_t end = min(ntimes, start + block_len);
+        if (reverse) {
+            scan.carry[end - 1] = scan.a[end - 1];
+            for (size_t t = end - 1; t-- > start;)
+                scan.carry[t] = scan.a[t]*scan.carry[t+1];
+        }
+        else {
+            scan.carry[start] = scan.a[start];
+            for (size_t t = start + 1; t < end; ++t)
+                scan.carry[t] = scan.carry[t-1]*scan.a[t];
+        }
+    }
+}
 
+
+
+void SmootherPlan::forward_scan(const LinearScan& scan, vector<double>& y, double y0) const
+{
+    const double* a = &scan.a[0];
+    const double* carry = &scan.carry[0];
+    double* x = &y[0];
+
+    if (nblocks == 1) {
+        x[0] += a[0]*y0;
+        for (size_t t = 1; t < ntimes; ++t)
+            x[t] += a[t]*x[t-1];
+        return;
+    }
+
+    // each block as if nothing were carried into it; the steps of different
+    // blocks do not depend on each other, so they are interleaved. a shorter
+    // last block is finished on its own
+    size_t full = ntimes / block_len;
+    for (size_t i = 1; i < block_len; ++i) {
+        for (size_t b = 0; b < full; ++b) {
+            size_t t = b*block_len + i;
+            x[t] += a[t]*x[t-1];
+        }
+    }
+    for (size_t t = full*block_len + 1; t < ntimes; ++t)
+        x[t] += a[t]*x[t-1];
+
+    // then what is carried into each block, which is known once the block
+    // before it is done
+    double carried = y0;
+    for (size_t b = 0; b < nblocks; ++b) {
+        size_t start = b*block_len;
+        size_t end = min(ntimes, start + block_len);
+        for (size_t t = start; t < end; ++t)
+            x[t] += carry[t]*carried;
+        carried = x[end - 1];
+    }
+}
+
+
+
+void SmootherPlan::reverse_scan(const LinearScan& scan, vector<double>& y) const
+{
+    const double* a = &scan.a[0];
+    const double* carry = &scan.carry[0];
+    double* x = &y[0];
+
+    if (nblocks == 1) {
+        for (size_t t = ntimes - 1; t-- > 0;)
+            x[t] += a[t]*x[t+1];
+        return;
+    }
+
+    size_t full = ntimes / block_len;
+    for (size_t i = 2; i <= block_len; ++i) {
+        for (size_t b = 0; b < full; ++b) {
+            size_t t = (b + 1)*block_len - i;
+            x[t] += a[t]*x[t+1];
+        }
+    }
+    for (size_t t = ntimes - 1; t-- > full*block_len;)
+        x[t] += a[t]*x[t+1];
+
+    double carried = 0;
+    for (size_t b = nblocks; b-- > 0;) {
+        size_t start = b*block_len;
+        size_t end = min(ntimes, start + block_len);
+        for (size_t t = start; t < end; ++t)
+            x[t] += carry[t]*carried;
+        carried = x[start];
+    }
+}
+
+
+
+VariationalKalmanSmoother::VariationalKalmanSmoother(const SmootherPlan& plan) :
+    plan(&plan),
+    f_mean(plan.time_points(), 0),
+    marg_mean(plan.time_points(), 0),
+    sum_phi(plan.time_points(), 0),
+    sum_zeta(plan.time_points(), 0),
+    initial_mean(0),
+    pop_size(plan.pop_size()),
+    parameters(plan.time_points() + 1, 0),
+    phi_zeta(plan.time_points(), 0),
+    diff_means(plan.time_points(), 0),
+    f_adjoint(plan.time_points(), 0),
+    marg_adjoint(plan.time_points(), 0),
+    dir_f_mean(plan.time_points(), 0),
+    dir_marg_mean(plan.time_points(), 0),
+    hess_diag(plan.time_points() + 1, 0),
+    hess_off(plan.time_points(), 0),
+    prev_parameters(plan.time_points() + 1, 0),
+    next_parameters(plan.time_points() + 1, 0),
+    grad(plan.time_points() + 1, 0),
+    direction(plan.time_points() + 1, 0),
+    time_points(plan.time_points()),
+    pop(0),
+    locus(0)
+{
+}
+
+
+
+void VariationalKalmanSmoother::reset(const SNPData& snp_data,
+                                      const LocusGenotypes& observed,
+                                      const vector3_ref<double>& outputs,
+                                      double initial_mean,
+                                      const vector3<double>& phi,
+                                      const vector3<double>& zeta,
+                                      size_t pop,
+                                      size_t locus)
 {
     this->initial_mean = initial_mean;
-    this->pop_size = pop_size;
-    this->out_var = 0.001;
-    this->total_time_steps = snp_data.total_time_steps();
-    this->dt[0] = 1;
-    this->var[0] = 1. / (12*pop_size);
+    this->pop = pop;
+    this->locus = locus;
     this->parameters[time_points] = initial_mean;
-    this->initial_variance = var[0];
     for (size_t t = 0; t < time_points; ++t) {
         parameters[t] = outputs[pop][locus][t];
-
-        if (t > 0) {
-            // store generation time
-            this->dt[t] = snp_data.get_sample_gen(t) - snp_data.get_sample_gen(t-1);
-        
-            // compute state space variance
-            var[t] = dt[t] / (12.*pop_size);
-        }
-        
-        // sums used in gradient/objective function calculation
-        // stored here so we don't have to recompute every iteration
-        // during optimization
         sum_phi[t] = 0;
         sum_zeta[t] = 0;
-        for (size_t d = 0; d < snp_data.total_individuals(t); ++d) {
-            if (snp_data.hidden(t, d, locus)) continue;
-            if (snp_data.hemizygous(t, d)) {
-                sum_phi[t] += 0.5*snp_data.genotype(t, d, locus) * phi[t][d][pop];
-                sum_zeta[t] += 0.5*(2 - snp_data.genotype(t, d, locus)) * zeta[t][d][pop];
-            }
-            else {
-                sum_phi[t] += snp_data.genotype(t, d, locus) * phi[t][d][pop];
-                sum_zeta[t] += (2 - snp_data.genotype(t, d, locus)) * zeta[t][d][pop];
-            }
+    }
+
+    // sums used in gradient/objective function calculation
+    // stored here so we don't have to recompute every iteration
+    // during optimization
+    for (size_t i = 0; i < observed.size(); ++i) {
+        size_t t = observed.time(i);
+        size_t d = observed.indiv(i);
+        double x = observed.genotype(i);
+        if (snp_data.hemizygous(t, d)) {
+            sum_phi[t] += 0.5*x * phi[t][d][pop];
+            sum_zeta[t] += 0.5*(2 - x) * zeta[t][d][pop];
+        }
+        else {
+            sum_phi[t] += x * phi[t][d][pop];
+            sum_zeta[t] += (2 - x) * zeta[t][d][pop];
         }
     }
 }
@@ -113,42 +273,47 @@ VariationalKalmanSmoother::VariationalKalmanSmoother(const SNPData& snp_data,
 
 
 void VariationalKalmanSmoother::maximize_pseudo_outputs()
+{
+    if (plan->solver() == SmootherPlan::NEWTON)
+        maximize_newton();
+    else
+        maximize_conjugate_gradient();
+}
+
+
+
+void VariationalKalmanSmoother::maximize_conjugate_gradient()
 {
     // store the previous and next iteration's parameter values
     // used to check for convergence. The last element of the vector
     // is the initial mean.
-    vector<double> prev(time_points + 1, 0); 
-    vector<double> next(time_points + 1, 0);
+    vector<double>& prev = prev_parameters;
+    vector<double>& next = next_parameters;
+    prev.clear();
+    next.clear();
 
     // vector of partial derivatives of marginal means with respect to pseudo-outputs
     // the last component is the partial derivative with respect to the initial mean
-    vector<double> grad(time_points + 1, 0);
+    grad.clear();
 
     // the vectors p are the conjugate vectors
-    vector<double> p(time_points + 1, 0);
+    vector<double>& p = direction;
+    p.clear();
 
     double b = 0;
     double prev_norm = 0;
     double norm = 0;
-    double step_size = 0.0001;
-
-    // the current and future values of the objective function
-    double obj = 0.0;
-    double nxt = 0.0;
 
     unsigned int it = 0;
     unsigned int max_iter = max(2*(time_points + 1), 10ul);
     //unsigned int max_iter = 50000;
 
-    double min_out = 0.01;
-    double max_out = 1 - min_out;
-
     while ( (!converged(prev, next)  || it < 2) && it < max_iter) {
-        compute_forward_partials();
-        compute_backward_partials();
+        compute_forward_equations();
+        compute_backward_equations();
         it++;
 
-        grad = prod(diff_means, diff_partials) + prod(phi_zeta, partials);
+        compute_gradient(grad);
         prev_norm = norm;
         norm = norm_2(grad);
 
@@ -162,32 +327,143 @@ void VariationalKalmanSmoother::maximize_pseudo_outputs()
         if (norm != 0 && prev_norm != 0)
             b = norm / prev_norm;
 
-        p = grad + b*p;
+        noalias(p) = grad + b*p;
         prev = parameters;
+        take_step(grad, p);
 
-        // Wolfe conditions
-        // we are minimizing the negative of the objective
-        step_size = 0.0001;
-        obj = compute_objective();
-        nxt = 0;
-        while ((-nxt > -obj - 0.0001*step_size*inner_prod(grad, p)) || nxt == 0) {
-            if (nxt != 0)
-                step_size = step_size / 2; 
-            for (size_t s = 0; s < parameters.size(); ++s) {
-                parameters[s] = prev[s] + step_size*p[s];
-                if (parameters[s] >= max_out) parameters[s] = max_out;
-                if (parameters[s] <= min_out) parameters[s] = min_out;
-            }
-            initial_mean = parameters[time_points];
-            nxt = compute_objective();
-        }
-        
         next = parameters;
     }
 }
 
 
 
+void VariationalKalmanSmoother::maximize_newton()
+{
+    // the previous and next iteration's parameter values, the last element
+    // of which is the initial mean
+    vector<double>& prev = prev_parameters;
+    vector<double>& next = next_parameters;
+    vector<double>& p = direction;
+    prev.clear();
+    next.clear();
+
+    // Newton steps converge in a few iterations unless the bounds on the
+    // pseudo-outputs are active, so the cap matches conjugate gradient
+    unsigned int it = 0;
+    unsigned int max_iter = max(2*(time_points + 1), 10ul);
+
+    while ( (!converged(prev, next) || it < 2) && it < max_iter) {
+        compute_forward_equations();
+        compute_backward_equations();
+        it++;
+
+        compute_gradient(grad);
+        double norm = norm_2(grad);
+        if (norm < 0.01 && norm != 0)
+            break;
+
+        compute_newton_direction(p);
+        prev = parameters;
+        take_step(grad, p);
+        next = parameters;
+    }
+}
+
+
+
+void VariationalKalmanSmoother::take_step(const vector<double>& grad, vector<double>& p)
+{
+    double min_out = 0.01;
+    double max_out = 1 - min_out;
+
+    // restart from the gradient if the direction is not an ascent direction
+    if (!(inner_prod(grad, p) > 0))
+        p = grad;
+
+    // parameters at a bound stay there if the direction points outside,
+    // then the step is limited so the rest stay within the bounds. If
+    // nothing is left of the direction there is no step to take; the bound
+    // starts finite because -Ofast assumes there are no infinities.
+    double max_step = numeric_limits<double>::max();
+    for (size_t s = 0; s < parameters.size(); ++s) {
+        if ((parameters[s] >= max_out && p[s] > 0) || (parameters[s] <= min_out && p[s] < 0))
+            p[s] = 0;
+        if (p[s] > 0)
+            max_step = min(max_step, (max_out - parameters[s]) / p[s]);
+        else if (p[s] < 0)
+            max_step = min(max_step, (min_out - parameters[s]) / p[s]);
+    }
+    if (max_step == numeric_limits<double>::max())
+        max_step = 0;
+
+    // the marginal means are linear in the parameters, so one pass over
+    // the direction gives them at every step, and the line search does
+    // not need to run the smoother again
+    double step_size = 0;
+    if (max_step > 0) {
+        compute_direction_means(p);
+        step_size = line_search(p, max_step);
+    }
+    for (size_t s = 0; s < parameters.size(); ++s) {
+        parameters[s] += step_size*p[s];
+        if (parameters[s] >= max_out) parameters[s] = max_out;
+        if (parameters[s] <= min_out) parameters[s] = min_out;
+    }
+    initial_mean = parameters[time_points];
+}
+
+
+
+void VariationalKalmanSmoother::compute_newton_direction(vector<double>& p)
+{
+    // In terms of z = (initial mean, marg_mean[0], ..., marg_mean[T-1]) the
+    // prior couples neighbouring elements and the likelihood is separable, so
+    // the negative Hessian is tridiagonal. A small ridge keeps it positive
+    // definite at loci without observations.
+    double ridge = 1e-6;
+    for (size_t t = 0; t < time_points; ++t) {
+        double m = marg_mean[t];
+        double v = plan->marg_var(t);
+        hess_diag[t+1] = ridge + plan->prior_precision(t) + sum_phi[t]*(1./(m*m) + 3*v/(m*m*m*m)) + sum_zeta[t]/((1 - m)*(1 - m));
+        hess_off[t] = -plan->prior_precision(t);
+    }
+    hess_diag[0] = ridge + plan->prior_precision(0);
+    for (size_t t = 1; t < time_points; ++t)
+        hess_diag[t] += plan->prior_precision(t);
+
+    // gradient with respect to z, from the terms kept by compute_gradient
+    p[0] = -diff_means[0];
+    for (size_t t = 0; t < time_points; ++t)
+        p[t+1] = phi_zeta[t] + diff_means[t] - (t + 1 < time_points ? diff_means[t+1] : 0);
+
+    // solve for the Newton step in z with the Thomas algorithm, using
+    // marg_adjoint for the modified superdiagonal
+    for (size_t t = 0; t < time_points; ++t) {
+        marg_adjoint[t] = hess_off[t] / hess_diag[t];
+        hess_diag[t+1] -= hess_off[t]*marg_adjoint[t];
+        p[t+1] -= hess_off[t]*p[t] / hess_diag[t];
+    }
+    p[time_points] /= hess_diag[time_points];
+    for (size_t t = time_points - 1; t < time_points; --t)
+        p[t] = p[t] / hess_diag[t] - marg_adjoint[t]*p[t+1];
+
+    // map the step in z back to the parameters by inverting the backward
+    // and then the forward recursion
+    double initial_step = p[0];
+    for (size_t t = 0; t < time_points; ++t)
+        dir_marg_mean[t] = p[t+1];
+    dir_f_mean[time_points - 1] = dir_marg_mean[time_points - 1];
+    for (size_t t = 0; t + 1 < time_points; ++t)
+        dir_f_mean[t] = (dir_marg_mean[t] - (1 - plan->backward_gain(t))*dir_marg_mean[t+1]) / plan->backward_gain(t);
+    for (size_t t = 0; t < time_points; ++t) {
+        double previous = (t > 0) ? dir_f_mean[t-1] : initial_step;
+        p[t] = (dir_f_mean[t] - plan->forward_gain(t)*previous) / (1 - plan->forward_gain(t));
+    }
+    p[time_points] = initial_step;
+}
+
+
+
 bool VariationalKalmanSmoother::converged(const vector<double>& v1, const vector<double>& v2)
 {
     bool has_converged = true;
@@ -202,18 +478,18 @@ bool VariationalKalmanSmoother::converged(const vector<double>& v1, const vector
 
 
 
-void VariationalKalmanSmoother::set_marginals(vector4<double>& freqs, size_t k, size_t l)
+void VariationalKalmanSmoother::set_marginals(vector4_ref<double>& freqs, size_t k, size_t l)
 {
     compute_forward_equations();
     compute_backward_equations();
     for (size_t t = 0; t < time_points; ++t) {
         freqs[t][k][l][0] = marg_mean[t];
-        freqs[t][k][l][1] = marg_var[t];
+        freqs[t][k][l][1] = plan->marg_var(t);
     }
 }
 
 
-void VariationalKalmanSmoother::set_outputs(vector3<double>& outputs)
+void VariationalKalmanSmoother::set_outputs(vector3_ref<double>& outputs)
 {
     for (size_t t = 0; t < time_points; ++t) {
         outputs[pop][locus][t] = parameters[t];
@@ -224,105 +500,131 @@ void VariationalKalmanSmoother::set_outputs(vector3<double>& outputs)
 
 void VariationalKalmanSmoother::compute_forward_equations()
 {
-    f_mean[0] = (out_var / (initial_variance + var[0] + out_var))*initial_mean
-              + (1 - out_var / (initial_variance + var[0] + out_var))*parameters[0];
-    f_var[0] = (out_var / (initial_variance + var[0] + out_var)) * (initial_variance + var[0]);
-    for (size_t t = 1; t < time_points; ++t) {
-        f_mean[t] = (out_var / (f_var[t-1] + var[t] + out_var))*f_mean[t-1]
-                  + (1 - out_var / (f_var[t-1] + var[t] + out_var))*parameters[t];
-        f_var[t] = (out_var / (f_var[t-1] + var[t] + out_var)) * (f_var[t-1] + var[t]);
+    for (size_t t = 0; t < time_points; ++t) {
+        f_mean[t] = (1 - plan->forward_gain(t))*parameters[t];
     }
+    plan->forward_scan(plan->forward_means(), f_mean, initial_mean);
 }
 
 
 
 void VariationalKalmanSmoother::compute_backward_equations()
 {
+    for (size_t t = 0; t + 1 < time_points; ++t) {
+        marg_mean[t] = plan->backward_gain(t)*f_mean[t];
+    }
     marg_mean[time_points - 1] = f_mean[time_points - 1];
-    marg_var[time_points - 1] = f_var[time_points - 1];
-    for (size_t t = time_points - 2; t < time_points; --t) {
-        marg_mean[t] = (var[t] / (f_var[t] + var[t]))*f_mean[t]
-                     + (1 - var[t]/ (f_var[t] + var[t]))*marg_mean[t+1];
-        marg_var[t] = f_var[t] + (f_var[t] / (f_var[t] + var[t]))*(f_var[t] / (f_var[t] + var[t])) * (marg_var[t+1] - f_var[t] - var[t]);
+    plan->reverse_scan(plan->backward_means(), marg_mean);
+}
+
+
+
+void VariationalKalmanSmoother::compute_gradient(vector<double>& grad)
+{
+    // derivatives of the objective with respect to the marginal means, which
+    // enter through the likelihood and the differences of consecutive means.
+    // These loops have no dependence between time steps, and are kept free of
+    // branches so that they are vectorized.
+    diff_means[0] = -(marg_mean[0] - initial_mean)*plan->prior_precision(0);
+    for (size_t t = 1; t < time_points; ++t)
+        diff_means[t] = -(marg_mean[t] - marg_mean[t-1])*plan->prior_precision(t);
+    for (size_t t = 0; t < time_points; ++t) {
+        double m = marg_mean[t];
+        double v = plan->marg_var(t);
+        phi_zeta[t] = sum_phi[t]*(1./m + v/(m*m*m)) + sum_zeta[t] / (m - 1);
+    }
+    for (size_t t = 0; t + 1 < time_points; ++t)
+        marg_adjoint[t] = phi_zeta[t] + diff_means[t] - diff_means[t+1];
+    marg_adjoint[time_points - 1] = phi_zeta[time_points - 1] + diff_means[time_points - 1];
+
+    // the mean recursions are linear, so the chain rule runs them in reverse:
+    // first the backward recursion from t = 0, then the forward recursion
+    // from the last time step
+    plan->forward_scan(plan->backward_adjoint(), marg_adjoint, 0);
+    for (size_t t = 0; t + 1 < time_points; ++t) {
+        f_adjoint[t] = plan->backward_gain(t)*marg_adjoint[t];
+    }
+    f_adjoint[time_points - 1] = marg_adjoint[time_points - 1];
+    plan->reverse_scan(plan->forward_adjoint(), f_adjoint);
+    for (size_t t = 0; t < time_points; ++t) {
+        grad[t] = (1 - plan->forward_gain(t))*f_adjoint[t];
     }
+
+    // the initial mean also enters the difference at the first time step
+    grad[time_points] = plan->forward_gain(0)*f_adjoint[0] - diff_means[0];
 }
 
 
 
-void VariationalKalmanSmoother::compute_forward_partials()
-{   
-    // forward means
-    f_mean[0] = (out_var / (initial_variance + var[0] + out_var))*initial_mean
-              + (1 - out_var / (initial_variance + var[0] + out_var))*parameters[0];
-    f_var[0] = (out_var / (initial_variance + var[0] + out_var)) * (initial_variance + var[0]);
-    
-    // initial mean
-    forward_partials(0, time_points) = (out_var / (initial_variance + var[0] + out_var));
+void VariationalKalmanSmoother::compute_direction_means(const vector<double>& p)
+{
+    for (size_t t = 0; t < time_points; ++t) {
+        dir_f_mean[t] = (1 - plan->forward_gain(t))*p[t];
+    }
+    plan->forward_scan(plan->forward_means(), dir_f_mean, p[time_points]);
+    for (size_t t = 0; t + 1 < time_points; ++t) {
+        dir_marg_mean[t] = plan->backward_gain(t)*dir_f_mean[t];
+    }
+    dir_marg_mean[time_points - 1] = dir_f_mean[time_points - 1];
+    plan->reverse_scan(plan->backward_means(), dir_marg_mean);
+}
+
 
-    forward_partials(0, 0) = (1 - out_var / (initial_variance + var[0] + out_var));
+
+void VariationalKalmanSmoother::line_derivatives(double s, const vector<double>& p, double& d1, double& d2)
+{
+    // -6N(m1 - m0)^2/dt, where m0 is the initial mean at the first time step
+    double dm = dir_marg_mean[0] - p[time_points];
+    double diff = marg_mean[0] - initial_mean + s*dm;
+    double a1 = -plan->prior_precision(0)*diff*dm;
+    double a2 = -plan->prior_precision(0)*dm*dm;
     for (size_t t = 1; t < time_points; ++t) {
+        dm = dir_marg_mean[t] - dir_marg_mean[t-1];
+        diff = marg_mean[t] - marg_mean[t-1] + s*dm;
+        a1 += -plan->prior_precision(t)*diff*dm;
+        a2 += -plan->prior_precision(t)*dm*dm;
+    }
 
-        // forward means
-        f_mean[t] = (out_var / (f_var[t-1] + var[t] + out_var))*f_mean[t-1]
-                  + (1 - out_var / (f_var[t-1] + var[t] + out_var))*parameters[t];
-        f_var[t] = (out_var / (f_var[t-1] + var[t] + out_var)) * (f_var[t-1] + var[t]);
-        
-        for (size_t s = 0; s < time_points; ++s) {
-             forward_partials(t, s) = (out_var / (f_var[t-1] + var[t] + out_var)) * forward_partials(t-1, s);
-             if (s == t)
-                forward_partials(t, s) += (1 - out_var/(f_var[t-1] + var[t] + out_var));
-        }
-        // initial mean
-        forward_partials(t, time_points) = forward_partials(t-1, time_points) * (out_var / (f_var[t-1] + var[t] + out_var));
+    // sum_phi*(log(m) - v/(2*m^2)) + sum_zeta*log(1 - m)
+    for (size_t t = 0; t < time_points; ++t) {
+        double m = marg_mean[t] + s*dir_marg_mean[t];
+        double dm = dir_marg_mean[t];
+        double v = plan->marg_var(t);
+        a1 += sum_phi[t]*(1./m + v/(m*m*m))*dm - sum_zeta[t]/(1 - m)*dm;
+        a2 += -sum_phi[t]*(1./(m*m) + 3*v/(m*m*m*m))*dm*dm - sum_zeta[t]/((1 - m)*(1 - m))*dm*dm;
     }
+    d1 = a1;
+    d2 = a2;
 }
 
 
 
-void VariationalKalmanSmoother::compute_backward_partials()
-{   
-    // marginal means
-    marg_mean[time_points - 1] = f_mean[time_points - 1];
-    marg_var[time_points - 1] = f_var[time_points - 1];
-
-    // initial mean
-    partials(time_points - 1, time_points) = forward_partials(time_points - 1, time_points);
-    diff_partials(time_points - 1, time_points) = partials(time_points - 1, time_points);
-    for (size_t t = time_points - 2; t < time_points; --t) {
-        // marginal means
-        marg_mean[t] = (var[t] / (f_var[t] + var[t]))*f_mean[t]
-                     + (1 - var[t]/ (f_var[t] + var[t]))*marg_mean[t+1];
-        marg_var[t] = f_var[t] + pow(f_var[t] / (f_var[t] + var[t]), 2) * (marg_var[t+1] - f_var[t] - var[t]);
-        
-        partials(t, time_points) = forward_partials(t, time_points) * var[t] / (f_var[t] + var[t]) 
-                                   + partials(t+1, time_points) * (1 - var[t] / (f_var[t] + var[t]));
-        diff_partials(t, time_points) = partials(t, time_points);
-        diff_partials(t+1, time_points) -= partials(t, time_points);
-    }
-    diff_partials(0, time_points) -= 1;
-
-    for (size_t s = 0; s < time_points; ++s) {
-        partials(time_points - 1, s) = forward_partials(time_points - 1, s);
-        diff_partials(time_points - 1, s) = partials(time_points - 1, s);
-        for (size_t t = time_points - 2; t < time_points; --t) {
-            partials(t, s) = (var[t] / (f_var[t] + var[t]))*forward_partials(t, s)
-                          + (1 - var[t] / (f_var[t] + var[t]))*partials(t+1, s);
-
-            diff_partials(t, s) = partials(t, s);
-            diff_partials(t+1, s) -= partials(t, s);
-        }
+double VariationalKalmanSmoother::line_search(const vector<double>& p, double max_step)
+{
+    // the objective is concave along the line, so its derivative decreases
+    // and the maximum is where it crosses zero. Newton steps are kept inside
+    // a bracket around the root, falling back to bisection.
+    double lo = 0;
+    double hi = max_step;
+    double d1, d2;
+    line_derivatives(hi, p, d1, d2);
+    if (d1 >= 0)
+        return hi;
+
+    double s = 0;
+    for (int i = 0; i < 50; ++i) {
+        line_derivatives(s, p, d1, d2);
+        if (d1 > 0)
+            lo = s;
+        else
+            hi = s;
+        if (abs(d1) < 1e-8 || hi - lo < 1e-12*max_step)
+            break;
 
-        // precompute difference of means and difference of partials
-        diff_means[s] = marg_mean[s];
-        if (s > 0) {
-            diff_means[s] -= marg_mean[s-1];
-        }
-        else {
-            diff_means[s] -= initial_mean;
-        }
-        diff_means[s] *= -12*pop_size/dt[s];
-        phi_zeta[s] = sum_phi[s]*(1./marg_mean[s] + marg_var[s]/(marg_mean[s]*marg_mean[s]*marg_mean[s])) + sum_zeta[s] / (marg_mean[s] - 1);
+        double next = (d2 < 0) ? s - d1 / d2 : hi;
+        s = (next > lo && next < hi) ? next : 0.5*(lo + hi);
     }
+    return s;
 }
 
 
@@ -343,13 +645,15 @@ double VariationalKalmanSmoother::compute_objective()
             m0 = initial_mean;
         }
         m1 = marg_mean[t];
+        double dt = plan->dt(t);
+        double marg_var = plan->marg_var(t);
         // E[log p(beta)] - E[log q(beta)]
-        obj += -6*pop_size*(m1 - m0)*(m1 - m0)/dt[t] - log(dt[t] / (12*pop_size)) - 12*pop_size*marg_var[t]/dt[t];
-        obj += 0.5*log(marg_var[t]);
+        obj += -6*pop_size*(m1 - m0)*(m1 - m0)/dt - log(dt / (12*pop_size)) - 12*pop_size*marg_var/dt;
+        obj += 0.5*log(marg_var);
 
         // E[log p(x)]
-        obj += sum_phi[t]*(log(m1) - marg_var[t]/(2*m1*m1)) + sum_zeta[t]*log(1 - m1);
+        obj += sum_phi[t]*(log(m1) - marg_var/(2*m1*m1)) + sum_zeta[t]*log(1 - m1);
     }
-    obj += 6*pop_size*marg_var[time_points - 1]/dt[time_points - 1];
+    obj += 6*pop_size*plan->marg_var(time_points - 1)/plan->dt(time_points - 1);
     return obj;
 }
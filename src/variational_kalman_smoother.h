@@ -21,7 +21,6 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #define KALMAN_SMOOTHER_H
 #define NDEBUG // for boost
 
-#include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 #include <vector>
 #include <utility>
@@ -31,75 +30,189 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 
 namespace ublas = boost::numeric::ublas;
 
+// A first-order linear recurrence y[t] = a[t]*y[t-1] + u[t], or y[t+1] for a
+// reverse recurrence, whose coefficients only depend on the time steps.
+// carry[t] is the product of the coefficients from the start of the block
+// holding t up to t (or from t to the end of the block in reverse), which
+// is the weight of the value carried into the block.
+struct LinearScan
+{
+    ublas::vector<double> a;
+    ublas::vector<double> carry;
+};
+
+// The parts of the smoother that only depend on the time steps and the
+// population size: the state space and output variances, the forward and
+// marginal variances, and the gains of the forward and backward recursions.
+// Built once and shared read-only by every smoother, along with the method
+// used to optimize the pseudo-outputs.
+class SmootherPlan
+{
+    public:
+        enum Solver { CONJUGATE_GRADIENT, NEWTON };
+
+        static const size_t SCAN_BLOCKS = 8;
+        static const size_t SCAN_MIN_TIME_STEPS = 256;
+
+        // The recurrences of the smoother are split into nscan_blocks blocks
+        // if there are at least min_scan_steps time steps, and are
+        // solved in one pass otherwise.
+        SmootherPlan(const SNPData& snp_data, double pop_size, Solver solver = CONJUGATE_GRADIENT,
+                     size_t nscan_blocks = SCAN_BLOCKS, size_t min_scan_steps = SCAN_MIN_TIME_STEPS);
+        SmootherPlan() { }
+
+        size_t time_points() const                                        { return ntimes; }
+        double pop_size() const                                           { return size; }
+        Solver solver() const                                             { return method; }
+        // the number of blocks the recurrences are split into, 1 if they are not
+        size_t scan_blocks() const                                        { return nblocks; }
+        double dt(size_t t) const                                         { return delta[t]; }
+        double prior_precision(size_t t) const                            { return precision[t]; }
+        double f_var(size_t t) const                                      { return forward_var[t]; }
+        double marg_var(size_t t) const                                   { return marginal_var[t]; }
+
+        // f_mean[t] = forward_gain(t)*f_mean[t-1] + (1 - forward_gain(t))*output[t],
+        // where f_mean[-1] is the initial mean
+        double forward_gain(size_t t) const                               { return f_gain[t]; }
+        // marg_mean[t] = backward_gain(t)*f_mean[t] + (1 - backward_gain(t))*marg_mean[t+1]
+        double backward_gain(size_t t) const                              { return b_gain[t]; }
+
+        // The recurrences of the smoother: the forward and marginal means,
+        // and in reverse for the gradient, the derivatives with respect to the
+        // marginal means and the forward means.
+        const LinearScan& forward_means() const                           { return f_mean_scan; }
+        const LinearScan& backward_means() const                          { return marg_mean_scan; }
+        const LinearScan& backward_adjoint() const                        { return marg_adjoint_scan; }
+        const LinearScan& forward_adjoint() const                         { return f_adjoint_scan; }
+
+        // Solves y[t] = a[t]*y[t-1] + y[t] in place, where y[-1] = y0. With
+        // many time steps, the time steps are split into blocks that are
+        // first solved side by side as if nothing were carried into them,
+        // and then joined in order, so that the recurrence is not one long
+        // chain of dependent operations.
+        void forward_scan(const LinearScan& scan, ublas::vector<double>& y, double y0) const;
+
+        // Solves y[t] = a[t]*y[t+1] + y[t] in place, where y[T] = 0.
+        void reverse_scan(const LinearScan& scan, ublas::vector<double>& y) const;
+
+    private:
+        // fills in scan.carry for the blocks, given scan.a
+        void set_carry(LinearScan& scan, bool reverse);
+
+        size_t                ntimes;
+        double                size;
+        Solver                method;
+        ublas::vector<double> delta;                          // number of generations between time steps
+        ublas::vector<double> precision;                      // 12*pop_size/delta, the inverse of the state space variance
+        ublas::vector<double> forward_var;
+        ublas::vector<double> marginal_var;
+        ublas::vector<double> f_gain;
+        ublas::vector<double> b_gain;
+        size_t                block_len;                      // time steps per block of a scan, or ntimes for one block
+        size_t                nblocks;
+        LinearScan            f_mean_scan;
+        LinearScan            marg_mean_scan;
+        LinearScan            marg_adjoint_scan;
+        LinearScan            f_adjoint_scan;
+};
+
+
+
 class VariationalKalmanSmoother
 {
     public:
-        // Takes the current value of the pseudo-outputs, and the variances from the state space model.
-        VariationalKalmanSmoother(const SNPData& snp_data,
-                                  const vector3<double>& outputs,
-                                  double initial_mean,
-                                  const vector3<double>& phi,
-                                  const vector3<double>& zeta,
-                                  double pop_size,
-                                  size_t pop,
-                                  size_t locus);
-
-        VariationalKalmanSmoother() { }
+        // Allocates the work space for the time steps of the plan. A smoother
+        // is reused across loci, and does not allocate memory after this.
+        VariationalKalmanSmoother(const SmootherPlan& plan);
+
+        // Starts over at one locus in one population from the current value
+        // of the pseudo-outputs. observed holds the observed genotypes at the
+        // locus.
+        void reset(const SNPData& snp_data,
+                   const LocusGenotypes& observed,
+                   const vector3_ref<double>& outputs,
+                   double initial_mean,
+                   const vector3<double>& phi,
+                   const vector3<double>& zeta,
+                   size_t pop,
+                   size_t locus);
 
         // optimizes variational pseudo-outputs at one locus in one population
-        // across all time steps using a conjugate gradient algorithm.
+        // across all time steps using the solver chosen in the plan.
         void maximize_pseudo_outputs();
 
         // computes the marginal mean and marginal variance at one locus in one
         // population across all time steps and sets freqs to these estimates.
-        void set_marginals(vector4<double>& freqs, size_t pop, size_t locus);
+        void set_marginals(vector4_ref<double>& freqs, size_t pop, size_t locus);
 
-        void set_outputs(vector3<double>& outputs);
+        void set_outputs(vector3_ref<double>& outputs);
 
-        // computes the forward mean and variance
+        // computes the forward means
         void compute_forward_equations();
 
-        // computes the marginal mean and variance using a backward recurrence
+        // computes the marginal means using a backward recurrence
         void compute_backward_equations();
 
-        // computes the partial derivatives of the forward means with
-        // respect to the pseudo outputs and initial mean
-        inline void compute_forward_partials();
-
-        // computes the partial derivatives of the backward means 
-        // with respect to the pseudo outputs and initial mean
-        inline void compute_backward_partials();
+        // computes the gradient of the objective with respect to the pseudo
+        // outputs and the initial mean from the current marginal means, by
+        // running the mean recursions in reverse in O(T)
+        void compute_gradient(ublas::vector<double>& grad);
 
         // compute the terms in the ELBO that depend on the pseudo-outputs
-        inline double compute_objective();
+        double compute_objective();
+
+        // computes the change in the forward and marginal means per unit
+        // step along the direction p, which includes the initial mean
+        inline void compute_direction_means(const ublas::vector<double>& p);
+
+        // first and second derivatives of the objective at a step s along p,
+        // where the marginal means are marg_mean + s*dir_marg_mean
+        inline void line_derivatives(double s, const ublas::vector<double>& p, double& d1, double& d2);
+
+        // maximizes the objective along p for steps in [0, max_step]
+        inline double line_search(const ublas::vector<double>& p, double max_step);
+
+        // moves the parameters to the maximum along p, keeping them within
+        // bounds. p is replaced by the gradient if it is not an ascent direction.
+        inline void take_step(const ublas::vector<double>& grad, ublas::vector<double>& p);
+
+        // sets p to the Newton direction for the current parameters. Must
+        // follow compute_gradient.
+        inline void compute_newton_direction(ublas::vector<double>& p);
 
         // compute the terms in the ELBO at the given locus that depend on population size
         double get_initial_mean() { return initial_mean; }
 
     private:
+        // nonlinear conjugate gradient
+        inline void maximize_conjugate_gradient();
+
+        // damped Newton iterations on the marginal means and the initial mean,
+        // where the Hessian is tridiagonal, mapped back to the pseudo-outputs
+        inline void maximize_newton();
+
         inline bool converged(const ublas::vector<double>& v1, const ublas::vector<double>& v2);
 
+        const SmootherPlan* plan;                             // variances and gains shared by all loci and populations
         ublas::vector<double> f_mean;                         // forward means
-        ublas::vector<double> f_var;                          // forward variances
         ublas::vector<double> marg_mean;                      // marginal/backward means
-        ublas::vector<double> marg_var;                       // marginal/backward variances
-        ublas::vector<double> var;                            // state space variance
-        double out_var;                                       // variational parameter for the output variance of the pseudo-outputs
-        ublas::matrix<double> forward_partials;
-        ublas::matrix<double> partials;                       // partial derivatives of marg_mean[t] with respect to outputs[s] (partials[t][s])
-        ublas::vector<double> param_forward_derivative;       // forward derivative with respect to initial mean
-        ublas::vector<double> param_backward_derivative;      // derivative with respect to initial mean
         ublas::vector<double> sum_phi;
         ublas::vector<double> sum_zeta;
         double initial_mean;
-        double initial_variance;
         double pop_size;
-        ublas::vector<double> dt;                             // number of generations between time steps
-        size_t total_time_steps;
         ublas::vector<double> parameters;
         ublas::vector<double> phi_zeta;
-        ublas::matrix<double> diff_partials;
         ublas::vector<double> diff_means;
+        ublas::vector<double> f_adjoint;                      // derivative of the objective with respect to f_mean[t]
+        ublas::vector<double> marg_adjoint;                   // derivative of the objective with respect to marg_mean[t]
+        ublas::vector<double> dir_f_mean;                     // change in the forward means along the search direction
+        ublas::vector<double> dir_marg_mean;                  // change in the marginal means along the search direction
+        ublas::vector<double> hess_diag;                      // negative Hessian with respect to the initial mean and the
+        ublas::vector<double> hess_off;                       // marginal means, which is tridiagonal
+        ublas::vector<double> prev_parameters;                // parameters before and after the last step of a solver
+        ublas::vector<double> next_parameters;
+        ublas::vector<double> grad;
+        ublas::vector<double> direction;                      // search direction of a solver
         size_t time_points;
         size_t pop;
         size_t locus;
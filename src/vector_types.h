@@ -21,6 +21,8 @@ along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
 #define VECTOR_TYPES_H
 
 #include <boost/multi_array.hpp>
+#include <cstddef>
+#include <vector>
 
 template <typename T>
 using vector2 = boost::multi_array<T, 2>;
@@ -34,4 +36,32 @@ using vector4 = boost::multi_array<T, 4>;
 template <typename T>
 using std_vector3 = std::vector<vector2<T> >;
 
+// arrays over storage that is owned elsewhere
+template <typename T>
+using vector2_ref = boost::multi_array_ref<T, 2>;
+
+template <typename T>
+using vector3_ref = boost::multi_array_ref<T, 3>;
+
+template <typename T>
+using vector4_ref = boost::multi_array_ref<T, 4>;
+
+// A storage order in which dimension slowest varies slowest and the other
+// dimensions keep their row major order, so that the elements sharing an
+// index in dimension slowest are contiguous.
+template <std::size_t N>
+boost::general_storage_order<N> slowest_varying(std::size_t slowest)
+{
+    std::size_t ordering[N];
+    bool        ascending[N];
+    std::size_t j = 0;
+    for (std::size_t i = N; i-- > 0; ) {
+        if (i != slowest)
+            ordering[j++] = i;
+        ascending[i] = true;
+    }
+    ordering[N - 1] = slowest;
+    return boost::general_storage_order<N>(ordering, ascending);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+#
+# Compares the running time of one epoch under each genotype matrix layout.
+# Run from the repository root. Extra arguments are passed to dystruct, e.g.
+#
+#   ./supp/scripts/benchmark_layout.sh --input FILE --generation-times FILE --nloci INT
+#
+# By default the example data is used.
+
+ARGS=("$@")
+if [ ${#ARGS[@]} -eq 0 ]; then
+    ARGS=(--input ./supp/example_data/samples.geno
+          --generation-times ./supp/example_data/sample_times
+          --nloci 10000)
+fi
+
+OUT=$(mktemp -d)
+for layout in individual locus; do
+    start=$(date +%s.%N)
+    ./bin/dystruct "${ARGS[@]}" \
+                   --output ${OUT}/${layout} \
+                   --npops 3 \
+                   --seed 1145 \
+                   --epochs 1 \
+                   --no-multi-init \
+                   --genotype-layout ${layout} > /dev/null
+    end=$(date +%s.%N)
+    awk -v l=${layout} -v s=${start} -v e=${end} 'BEGIN { printf "%s\t%.2f seconds\n", l, e - s }'
+done
+rm -r ${OUT}
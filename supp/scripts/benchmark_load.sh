@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+#
+# Measures how long dystruct takes to load a dataset, from startup until the
+# main algorithm starts, over a few runs. Run from the repository root. Extra
+# arguments are passed to dystruct, e.g.
+#
+#   ./supp/scripts/benchmark_load.sh --input FILE --generation-times FILE --nloci INT
+#
+# By default the example data is used. Set DYSTRUCT to time another build,
+# and RUNS to change the number of runs.
+
+DYSTRUCT=${DYSTRUCT:-./bin/dystruct}
+RUNS=${RUNS:-3}
+
+ARGS=("$@")
+if [ ${#ARGS[@]} -eq 0 ]; then
+    ARGS=(--input ./supp/example_data/samples.geno
+          --generation-times ./supp/example_data/sample_times
+          --nloci 10000)
+fi
+
+OUT=$(mktemp -d)
+for run in $(seq ${RUNS}); do
+    start=$(date +%s.%N)
+    exec 3< <(${DYSTRUCT} "${ARGS[@]}" \
+                          --output ${OUT}/run \
+                          --npops 3 \
+                          --seed 1145 \
+                          --epochs 1 \
+                          --no-multi-init 2> /dev/null)
+    pid=$!
+    end=""
+    while read -r line <&3; do
+        if [ "${line}" = "running main algorithm..." ]; then
+            end=$(date +%s.%N)
+            break
+        fi
+    done
+    kill ${pid} 2> /dev/null
+    exec 3<&-
+    if [ -z "${end}" ]; then
+        echo "dystruct stopped before loading finished" >&2
+        rm -r ${OUT}
+        exit 1
+    fi
+    awk -v r=${run} -v s=${start} -v e=${end} 'BEGIN { printf "run %d\t%.2f seconds\n", r, e - s }'
+done
+rm -r ${OUT}
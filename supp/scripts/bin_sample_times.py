@@ -17,7 +17,7 @@ time_gen = np.array(time_gen)
 # make sure generations begin at 0
 time_gen = time_gen - time_gen.min()
 
-bucket_size = 50
+bucket_size = int(args.bucket_size)
 buckets = [[] for i in range(int(time_gen.max() / bucket_size)+1)]
 for idx,g in enumerate(time_gen):
     bucket_idx = int(g / bucket_size) 
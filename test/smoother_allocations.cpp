@@ -0,0 +1,102 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks that a smoother does not allocate memory once it is constructed:
+// SVI reuses one smoother per population for every locus, so the calls
+// below run for every locus and population in each epoch.
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "smoother_fixture.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::vector;
+
+// every allocation through new goes through these
+static size_t nallocations = 0;
+
+void* operator new(size_t size)
+{
+    nallocations++;
+    void* p = std::malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+
+
+int main()
+{
+    const size_t ntimes[] = { 36, 300 };
+    const SmootherPlan::Solver solvers[] = { SmootherPlan::CONJUGATE_GRADIENT, SmootherPlan::NEWTON };
+    const int nrounds = 5;
+
+    bool ok = true;
+    for (size_t n = 0; n < sizeof(ntimes) / sizeof(ntimes[0]); ++n) {
+        for (size_t s = 0; s < sizeof(solvers) / sizeof(solvers[0]); ++s) {
+            size_t T = ntimes[n];
+            SmootherFixture data(T, 3, 2000 + n);
+            SmootherPlan plan(data.snp_data, 5000, solvers[s]);
+            VariationalKalmanSmoother vks(plan);
+            vector<double> freq_storage(2*T);
+            vector4_ref<double> freqs(&freq_storage[0], boost::extents[T][1][1][2]);
+
+            // each round starts from the pseudo-outputs of the last, as the
+            // epochs of SVI do, with a different initial mean
+            size_t before = nallocations;
+            for (int r = 0; r < nrounds; ++r) {
+                data.initial_mean = 0.3 + 0.1*r;
+                data.reset(vks);
+                vks.maximize_pseudo_outputs();
+                vks.set_marginals(freqs, 0, 0);
+                vks.set_outputs(data.outputs);
+            }
+            size_t count = nallocations - before;
+
+            cout << "T = " << T << ", solver " << (solvers[s] == SmootherPlan::NEWTON ? "newton" : "cg")
+                 << ": " << count << " allocations in " << nrounds << " rounds" << endl;
+            if (count != 0) {
+                cerr << "smoother allocated memory after construction" << endl;
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SMOOTHER_FIXTURE_H
+#define SMOOTHER_FIXTURE_H
+
+#include "../src/variational_kalman_smoother.h"
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "../src/genotype_matrix.h"
+#include "../src/snp_data.h"
+#include "../src/vector_types.h"
+
+// A random data set for running the smoother outside of SVI: one locus and
+// one population, with nindividuals individuals sampled at each of ntimes
+// time steps a random number of generations apart. Genotypes are random
+// with some missing, and phi, zeta and the pseudo-outputs are random in
+// ranges that keep the marginal means inside (0, 1).
+class SmootherFixture
+{
+    public:
+        SmootherFixture(size_t ntimes, size_t nindividuals, unsigned int seed) :
+            snps(genotypes(ntimes, nindividuals, seed)),
+            snp_data(&snps, generations(ntimes, seed), 0, seed, false, 1),
+            output_storage(ntimes),
+            outputs(&output_storage[0], boost::extents[1][1][ntimes]),
+            initial_mean(0.5),
+            phi(boost::extents[ntimes][nindividuals][1]),
+            zeta(boost::extents[ntimes][nindividuals][1])
+        {
+            snp_data.observed_genotypes(0, observed);
+            boost::random::mt19937 gen(seed);
+            boost::random::uniform_real_distribution<double> output_dist(0.2, 0.8);
+            boost::random::uniform_real_distribution<double> phi_dist(0.05, 1);
+            for (size_t t = 0; t < ntimes; ++t) {
+                outputs[0][0][t] = output_dist(gen);
+                for (size_t d = 0; d < nindividuals; ++d) {
+                    phi[t][d][0] = phi_dist(gen);
+                    zeta[t][d][0] = phi_dist(gen);
+                }
+            }
+        }
+
+        // starts vks over from the current pseudo-outputs and initial mean
+        void reset(VariationalKalmanSmoother& vks) const
+        {
+            vks.reset(snp_data, observed, outputs, initial_mean, phi, zeta, 0, 0);
+        }
+
+        GenotypeMatrix       snps;
+        SNPData              snp_data;
+        LocusGenotypes       observed;                          // observed genotypes at the locus
+        std::vector<double>  output_storage;
+        vector3_ref<double>  outputs;                           // pseudo-outputs, indexed [pop][locus][t]
+        double               initial_mean;
+        vector3<double>      phi;
+        vector3<double>      zeta;
+
+    private:
+        static GenotypeMatrix genotypes(size_t ntimes, size_t nindividuals, unsigned int seed)
+        {
+            boost::random::mt19937 gen(seed);
+            boost::random::uniform_int_distribution<int> code_dist(0, GenotypeMatrix::MISSING);
+            GenotypeMatrix m(std::vector<int>(ntimes, nindividuals), 1, GenotypeMatrix::LOCUS_MAJOR);
+            uint64_t* words = m.stripe(0);
+            for (size_t r = 0; r < m.total_rows(); ++r) {
+                uint64_t& w = words[r / GenotypeMatrix::CODES_PER_WORD];
+                size_t shift = 2*(r % GenotypeMatrix::CODES_PER_WORD);
+                w = (w & ~((uint64_t)3 << shift)) | ((uint64_t)code_dist(gen) << shift);
+            }
+            return m;
+        }
+
+        // increasing generation times, between 1 and 20 generations apart
+        static std::vector<int> generations(size_t ntimes, unsigned int seed)
+        {
+            boost::random::mt19937 gen(seed + 1);
+            boost::random::uniform_int_distribution<int> gap_dist(1, 20);
+            std::vector<int> gens(ntimes, 0);
+            for (size_t t = 1; t < ntimes; ++t)
+                gens[t] = gens[t-1] + gap_dist(gen);
+            return gens;
+        }
+};
+
+#endif
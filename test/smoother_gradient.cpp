@@ -0,0 +1,81 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the gradient of the smoother objective, computed by the adjoint
+// recursions in compute_gradient, against central differences of
+// compute_objective with respect to each pseudo-output and the initial mean.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "smoother_fixture.h"
+
+using std::abs;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::max;
+
+int main()
+{
+    const size_t ntimes[] = { 1, 2, 36, 255, 256, 300, 2000 };
+    const double step = 1e-6;
+    const double tolerance = 1e-5;
+
+    bool ok = true;
+    for (size_t n = 0; n < sizeof(ntimes) / sizeof(ntimes[0]); ++n) {
+        size_t T = ntimes[n];
+        SmootherFixture data(T, 3, 1000 + n);
+        SmootherPlan plan(data.snp_data, 5000);
+        VariationalKalmanSmoother vks(plan);
+
+        data.reset(vks);
+        vks.compute_objective();
+        ublas::vector<double> grad(T + 1);
+        vks.compute_gradient(grad);
+
+        // the largest error relative to the largest derivative, since
+        // single derivatives can be close to 0
+        double max_error = 0;
+        double max_grad = 0;
+        for (size_t i = 0; i <= T; ++i) {
+            double& x = (i < T) ? data.outputs[0][0][i] : data.initial_mean;
+            double x0 = x;
+            x = x0 + step;
+            data.reset(vks);
+            double up = vks.compute_objective();
+            x = x0 - step;
+            data.reset(vks);
+            double down = vks.compute_objective();
+            x = x0;
+
+            max_error = max(max_error, abs((up - down) / (2*step) - grad[i]));
+            max_grad = max(max_grad, abs(grad[i]));
+        }
+
+        double error = max_error / max_grad;
+        cout << "T = " << T << ": relative gradient error " << error << endl;
+        if (!(error < tolerance)) {
+            cerr << "gradient differs from finite differences at T = " << T << endl;
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+/*
+Copyright (C) 2017-2018 Tyler Joseph <tjoseph@cs.columbia.edu>
+
+This file is part of Dystruct.
+
+Dystruct is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Dystruct is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Dystruct.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the recurrences of the smoother split into blocks against the same
+// recurrences solved in one pass, for plans built from the same data: each
+// scan on random inputs, and the objective and gradient of a smoother.
+
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <cmath>
+#include <iostream>
+
+#include "smoother_fixture.h"
+
+using boost::random::mt19937;
+using boost::random::uniform_real_distribution;
+using std::abs;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::max;
+
+const double TOLERANCE = 1e-12;
+
+// largest difference between a and b relative to the largest entry of a
+double relative_error(const ublas::vector<double>& a, const ublas::vector<double>& b)
+{
+    double max_error = 0;
+    double max_value = 0;
+    for (size_t t = 0; t < a.size(); ++t) {
+        max_error = max(max_error, abs(a[t] - b[t]));
+        max_value = max(max_value, abs(a[t]));
+    }
+    return max_error / max_value;
+}
+
+
+
+// solves one recurrence from random inputs with both plans
+double scan_error(const SmootherPlan& sequential, const LinearScan& sequential_scan,
+                  const SmootherPlan& blocked, const LinearScan& blocked_scan,
+                  bool reverse, mt19937& gen)
+{
+    uniform_real_distribution<double> dist(-1, 1);
+    ublas::vector<double> y1(sequential.time_points());
+    for (size_t t = 0; t < y1.size(); ++t)
+        y1[t] = dist(gen);
+    ublas::vector<double> y2(y1);
+    double y0 = dist(gen);
+
+    if (reverse) {
+        sequential.reverse_scan(sequential_scan, y1);
+        blocked.reverse_scan(blocked_scan, y2);
+    }
+    else {
+        sequential.forward_scan(sequential_scan, y1, y0);
+        blocked.forward_scan(blocked_scan, y2, y0);
+    }
+    return relative_error(y1, y2);
+}
+
+
+
+// compares the plans with the given blocking against a plan solving the
+// recurrences in one pass
+bool check(size_t T, size_t nblocks, size_t min_steps, bool split, unsigned int seed)
+{
+    SmootherFixture data(T, 3, seed);
+    SmootherPlan sequential(data.snp_data, 5000, SmootherPlan::CONJUGATE_GRADIENT, 1);
+    SmootherPlan blocked(data.snp_data, 5000, SmootherPlan::CONJUGATE_GRADIENT, nblocks, min_steps);
+    if (sequential.scan_blocks() != 1 || (blocked.scan_blocks() > 1) != split) {
+        cerr << "T = " << T << ": recurrences split into " << blocked.scan_blocks() << " blocks" << endl;
+        return false;
+    }
+
+    mt19937 gen(seed);
+    double error = 0;
+    error = max(error, scan_error(sequential, sequential.forward_means(), blocked, blocked.forward_means(), false, gen));
+    error = max(error, scan_error(sequential, sequential.backward_means(), blocked, blocked.backward_means(), true, gen));
+    error = max(error, scan_error(sequential, sequential.backward_adjoint(), blocked, blocked.backward_adjoint(), false, gen));
+    error = max(error, scan_error(sequential, sequential.forward_adjoint(), blocked, blocked.forward_adjoint(), true, gen));
+
+    VariationalKalmanSmoother vks1(sequential);
+    VariationalKalmanSmoother vks2(blocked);
+    data.reset(vks1);
+    data.reset(vks2);
+    double obj1 = vks1.compute_objective();
+    double obj2 = vks2.compute_objective();
+    ublas::vector<double> grad1(T + 1);
+    ublas::vector<double> grad2(T + 1);
+    vks1.compute_gradient(grad1);
+    vks2.compute_gradient(grad2);
+    error = max(error, abs(obj1 - obj2) / abs(obj1));
+    error = max(error, relative_error(grad1, grad2));
+
+    cout << "T = " << T << ", " << blocked.scan_blocks() << " blocks: relative error " << error << endl;
+    if (!(error < TOLERANCE)) {
+        cerr << "blocked recurrences differ from one pass at T = " << T << endl;
+        return false;
+    }
+    return true;
+}
+
+
+
+int main()
+{
+    bool ok = true;
+
+    // the default blocking, just below and above the threshold, and with a
+    // shorter last block
+    const size_t ntimes[] = { SmootherPlan::SCAN_MIN_TIME_STEPS - 1, SmootherPlan::SCAN_MIN_TIME_STEPS,
+                              SmootherPlan::SCAN_MIN_TIME_STEPS + 1, 300, 1001, 2000 };
+    for (size_t n = 0; n < sizeof(ntimes) / sizeof(ntimes[0]); ++n) {
+        size_t T = ntimes[n];
+        ok &= check(T, SmootherPlan::SCAN_BLOCKS, SmootherPlan::SCAN_MIN_TIME_STEPS,
+                    T >= SmootherPlan::SCAN_MIN_TIME_STEPS, 3000 + n);
+    }
+
+    // blocking forced on few time steps, including blocks of a single step
+    const size_t short_ntimes[] = { 2, 3, 36, 37 };
+    const size_t nblocks[] = { 2, 3, 5, 8 };
+    for (size_t n = 0; n < sizeof(short_ntimes) / sizeof(short_ntimes[0]); ++n) {
+        for (size_t b = 0; b < sizeof(nblocks) / sizeof(nblocks[0]); ++b)
+            ok &= check(short_ntimes[n], nblocks[b], 1, true, 4000 + 10*n + b);
+    }
+    return ok ? 0 : 1;
+}